@@ -0,0 +1,68 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "common.h"
+
+#define CKPT_MAGIC 0x4b43534f /* "OSCK" */
+#define CKPT_VERSION 1
+/* Device contents start on a host page so a restore can map them */
+#define CKPT_ALIGN 4096
+
+/* What a CPU keeps between time slots, see cpu_routine */
+struct cpu_state {
+	struct pcb_t * proc; // Running process, NULL when idle
+	int time_left;       // Slots left of its time slice
+	int stall;           // Slots it still has to sit out
+	int stopped;         // Left the simulation, nothing more to run
+};
+
+/* Simulation state owned by os.c */
+struct ckpt_os {
+	int num_cpus;
+	struct cpu_state * cpus;
+	int num_processes;
+	int ld_next;                // Next process of the config to load
+	struct pcb_t * ld_pending;  // Loaded, waiting for its start time
+#ifdef MM_PAGING
+	struct memphy_struct * mram;
+	struct memphy_struct ** mswp;
+#endif
+};
+
+/* A checkpoint file mapped for reading */
+struct ckpt_image {
+	BYTE * base;
+	size_t size;
+	size_t off;
+	int fd;
+};
+
+int checkpoint_save(const char * path, struct ckpt_os * os);
+int checkpoint_restore(const char * path, struct ckpt_os * os);
+
+void ckpt_write(FILE * file, const void * buf, size_t len);
+void ckpt_write_align(FILE * file);
+void ckpt_write_sparse(FILE * file, const BYTE * buf, size_t len);
+int ckpt_read(struct ckpt_image * img, void * buf, size_t len);
+int ckpt_read_align(struct ckpt_image * img);
+struct pcb_t * ckpt_find_pcb(uint32_t pid);
+
+/* Timer side, the checkpoint is taken between two time slots */
+void set_time(uint64_t time);
+void set_timer_hook(uint64_t time, void (*hook)(void));
+
+/* Scheduler queues, processes by PID */
+int sched_procs(struct pcb_t ** procs, int max);
+void sched_save(FILE * file);
+int sched_restore(struct ckpt_image * img);
+
+#ifdef MM_PAGING
+int mm_save(FILE * file, struct mm_struct * mm);
+int mm_restore(struct ckpt_image * img, struct mm_struct * mm);
+void shm_save(FILE * file);
+int shm_restore(struct ckpt_image * img);
+int MEMPHY_save(FILE * file, struct memphy_struct * mp);
+int MEMPHY_restore(struct ckpt_image * img, struct memphy_struct * mp);
+#endif
+
+#endif
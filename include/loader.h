@@ -0,0 +1,16 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include "common.h"
+
+struct pcb_t * load(const char * path);
+
+/* Create a new PCB running the same code from the same point as [proc] */
+struct pcb_t * clone_pcb(struct pcb_t * proc);
+
+/* PID the next process gets, saved and restored with a checkpoint */
+uint32_t get_avail_pid(void);
+void set_avail_pid(uint32_t pid);
+
+#endif
+
@@ -0,0 +1,329 @@
+#ifndef MM_H
+
+#include "bitops.h"
+#include "common.h"
+
+/* CPU Bus definition */
+#define PAGING_CPU_BUS_WIDTH 22 /* 22bit bus - MAX SPACE 4MB */
+#define PAGING_PAGESZ  256      /* 256B or 8-bits PAGE NUMBER */
+#define PAGING_MEMRAMSZ BIT(21)
+#define PAGING_PAGE_ALIGNSZ(sz) (DIV_ROUND_UP(sz,PAGING_PAGESZ)*PAGING_PAGESZ)
+
+#define PAGING_MEMSWPSZ BIT(29)
+#define PAGING_SWPFPN_OFFSET 5  
+#define PAGING_MAX_PGN  (DIV_ROUND_UP(BIT(PAGING_CPU_BUS_WIDTH),PAGING_PAGESZ))
+
+#define PAGING_SBRK_INIT_SZ PAGING_PAGESZ
+
+/* FRAME BITMAP */
+#define MEMPHY_MAP_WORDSZ 64
+#define MEMPHY_MAP_WORD(fpn) ((fpn) / MEMPHY_MAP_WORDSZ)
+#define MEMPHY_MAP_MASK(fpn) (1ULL << ((fpn) % MEMPHY_MAP_WORDSZ))
+#define MEMPHY_MAP_NWORDS(n) DIV_ROUND_UP(n,MEMPHY_MAP_WORDSZ)
+
+/* BUDDY BLOCK: 2^order contiguous frames aligned to their size */
+#define MEMPHY_MAX_ORDER 10
+
+/* NUMA: MEMRAM nodes, CPU i allocates from node i % nnodes first */
+#define MEMPHY_MAX_NODES 4
+
+/* DUMP: binary records of the frames changed, see MEMPHY_dump */
+#define MEMPHY_DUMP_FILE "RAM_status.bin"
+#define MEMPHY_DUMP_MAGIC 0x444d454d /* "MEMD" */
+#define MEMPHY_DUMP_FREE 0x80000000  /* entry of a released frame, no data */
+#define MEMPHY_DUMP_END 0xffffffff
+/* PTE BIT */
+#define PAGING_PTE_PRESENT_MASK BIT(31) 
+#define PAGING_PTE_SWAPPED_MASK BIT(30)
+#define PAGING_PTE_RESERVE_MASK BIT(29)
+#define PAGING_PTE_DIRTY_MASK BIT(28)
+#define PAGING_PTE_EMPTY01_MASK BIT(14)
+#define PAGING_PTE_EMPTY02_MASK BIT(13)
+
+/* PTE BIT HUGE: one head PTE maps PAGING_HUGE_NPAGES contiguous frames */
+#define PAGING_PTE_HUGE_MASK PAGING_PTE_RESERVE_MASK
+#define PAGING_PAGE_HUGE(pte) (pte&PAGING_PTE_HUGE_MASK)
+#define PAGING_HUGE_ORDER 8
+#define PAGING_HUGE_NPAGES BIT(PAGING_HUGE_ORDER)
+#define PAGING_HUGE_PAGESZ (PAGING_HUGE_NPAGES*PAGING_PAGESZ)
+#define PAGING_HUGE_PGN(pgn) ((pgn)&~(PAGING_HUGE_NPAGES-1))
+/* Frames held by the on-line pages of an mm */
+#define PAGING_RSS(mm) ((mm)->fifo_pgn.count + (mm)->nhuge * (PAGING_HUGE_NPAGES - 1))
+
+/* PTE BIT PRESENT */
+#define PAGING_PTE_SET_PRESENT(pte) (pte=pte|PAGING_PTE_PRESENT_MASK)
+#define PAGING_PAGE_PRESENT(pte) (pte&PAGING_PTE_PRESENT_MASK)
+
+/* PTE BIT ACCESSED (on-line pages only, the bit overlaps SWPOFF) */
+#define PAGING_PTE_ACCESSED_MASK PAGING_PTE_EMPTY01_MASK
+#define PAGING_PTE_SET_ACCESSED(pte) (pte=pte|PAGING_PTE_ACCESSED_MASK)
+#define PAGING_PAGE_ACCESSED(pte) (pte&PAGING_PTE_ACCESSED_MASK)
+
+/* PTE BIT COW: on-line page shared read-only after FORK */
+#define PAGING_PTE_COW_MASK PAGING_PTE_EMPTY02_MASK
+#define PAGING_PAGE_COW(pte) (pte&PAGING_PTE_COW_MASK)
+
+/* PTE BIT RDAHEAD: on-line page read ahead from swap, not used yet */
+#define PAGING_PTE_RDAHEAD_MASK BIT(PAGING_PTE_USRNUM_LOBIT)
+
+/* TLB */
+#define TLB_NENTRY 64
+
+/* Same page merging hash table */
+#define KSM_NBUCKET 1024
+
+/* Background reclaim thread arguments */
+struct kswapd_args
+{
+	struct timer_id_t *timer_id;
+	struct memphy_struct *mram;
+};
+
+/* Swap device selection */
+enum swp_policy_t
+{
+	SWP_RR,     // Devices in turn
+	SWP_LEAST,  // Device with the most free frames
+	SWP_STRIPE  // Device by page number
+};
+
+/* Page replacement policies */
+enum pgrepl_policy_t
+{
+	PGREPL_FIFO,  // Oldest on-line page
+	PGREPL_SC,    // Second chance, referenced pages go back to the tail
+	PGREPL_CLOCK, // Second chance with a hand instead of moving pages
+	PGREPL_LRU    // Aging approximation of LRU
+};
+
+/* USRNUM */
+#define PAGING_PTE_USRNUM_LOBIT 15
+#define PAGING_PTE_USRNUM_HIBIT 27
+/* FPN */
+#define PAGING_PTE_FPN_LOBIT 0
+#define PAGING_PTE_FPN_HIBIT 12
+/* SWPTYP */
+#define PAGING_PTE_SWPTYP_LOBIT 0
+#define PAGING_PTE_SWPTYP_HIBIT 4
+/* SWPOFF */
+#define PAGING_PTE_SWPOFF_LOBIT 5
+#define PAGING_PTE_SWPOFF_HIBIT 25
+
+
+#define PAGING_PTE_USRNUM_MASK GENMASK(PAGING_PTE_USRNUM_HIBIT,PAGING_PTE_USRNUM_LOBIT)
+#define PAGING_PTE_FPN_MASK    GENMASK(PAGING_PTE_FPN_HIBIT,PAGING_PTE_FPN_LOBIT)
+#define PAGING_PTE_SWPTYP_MASK GENMASK(PAGING_PTE_SWPTYP_HIBIT,PAGING_PTE_SWPTYP_LOBIT)
+#define PAGING_PTE_SWPOFF_MASK GENMASK(PAGING_PTE_SWPOFF_HIBIT,PAGING_PTE_SWPOFF_LOBIT)
+
+/* OFFSET */
+#define PAGING_ADDR_OFFST_LOBIT 0
+#define PAGING_ADDR_OFFST_HIBIT (NBITS(PAGING_PAGESZ) - 1)
+
+/* PAGE Num */
+#define PAGING_ADDR_PGN_LOBIT NBITS(PAGING_PAGESZ)
+#define PAGING_ADDR_PGN_HIBIT (PAGING_CPU_BUS_WIDTH - 1)
+
+/* Frame PHY Num */
+#define PAGING_ADDR_FPN_LOBIT NBITS(PAGING_PAGESZ)
+#define PAGING_ADDR_FPN_HIBIT (NBITS(PAGING_MEMRAMSZ) - 1)
+
+/* SWAPFPN */
+#define PAGING_SWP_LOBIT NBITS(PAGING_PAGESZ)
+#define PAGING_SWP_HIBIT (NBITS(PAGING_MEMSWPSZ) - 1)
+#define PAGING_SWP(pte) ((pte&PAGING_PTE_SWPOFF_MASK) >> PAGING_SWPFPN_OFFSET)
+#define PAGING_SWPTYP(pte) ((pte&PAGING_PTE_SWPTYP_MASK) >> PAGING_PTE_SWPTYP_LOBIT)
+
+/* SWAP SLOT: device and frame of an off-line page in one int */
+#define PAGING_SWPSLOT_TYPBITS 2
+#define PAGING_SWPSLOT(typ, off) (((off) << PAGING_SWPSLOT_TYPBITS) | (typ))
+#define PAGING_SWPSLOT_TYP(slot) ((slot) & (BIT(PAGING_SWPSLOT_TYPBITS) - 1))
+#define PAGING_SWPSLOT_OFF(slot) ((slot) >> PAGING_SWPSLOT_TYPBITS)
+#define PAGING_PTE_SWPSLOT(pte) PAGING_SWPSLOT(PAGING_SWPTYP(pte), PAGING_SWP(pte))
+
+/* Value operators */
+#define SETBIT(v,mask) (v=v|mask)
+#define CLRBIT(v,mask) (v=v&~mask)
+
+#define SETVAL(v,value,mask,offst) (v=(v&~mask)|((value<<offst)&mask))
+#define GETVAL(v,mask,offst) ((v&mask)>>offst)
+
+/* Masks */
+#define PAGING_OFFST_MASK  GENMASK(PAGING_ADDR_OFFST_HIBIT,PAGING_ADDR_OFFST_LOBIT)
+#define PAGING_PGN_MASK  GENMASK(PAGING_ADDR_PGN_HIBIT,PAGING_ADDR_PGN_LOBIT)
+#define PAGING_FPN_MASK  GENMASK(PAGING_ADDR_FPN_HIBIT,PAGING_ADDR_FPN_LOBIT)
+#define PAGING_SWP_MASK  GENMASK(PAGING_SWP_HIBIT,PAGING_SWP_LOBIT)
+
+/* Extract OFFSET */
+//#define PAGING_OFFST(x)  ((x&PAGING_OFFST_MASK) >> PAGING_ADDR_OFFST_LOBIT)
+#define PAGING_OFFST(x)  GETVAL(x,PAGING_OFFST_MASK,PAGING_ADDR_OFFST_LOBIT)
+/* Extract Page Number*/
+#define PAGING_PGN(x)  GETVAL(x,PAGING_PGN_MASK,PAGING_ADDR_PGN_LOBIT)
+/* Extract FramePHY Number*/
+#define PAGING_FPN(x)  GETVAL(x,PAGING_PTE_FPN_MASK,PAGING_PTE_FPN_LOBIT)
+/* Extract SWAPFPN */
+#define PAGING_PGN(x)  GETVAL(x,PAGING_PGN_MASK,PAGING_ADDR_PGN_LOBIT)
+/* Extract SWAPTYPE */
+#define PAGING_FPN(x)  GETVAL(x,PAGING_PTE_FPN_MASK,PAGING_PTE_FPN_LOBIT)
+
+/* Memory range operator */
+#define INCLUDE(x1,x2,y1,y2) (((y1-x1)*(x2-y2)>=0)?1:0)
+#define OVERLAP(x1,x2,y1,y2) (((y2-x1)*(x2-y1)>=0)?1:0)
+
+/* VM region prototypes */
+struct vm_rg_struct * init_vm_rg(int rg_start, int rg_endi);
+int enlist_vm_rg_node(struct vm_rg_struct **rglist, struct vm_rg_struct* rgnode);
+int init_pgn_list(struct pgn_list *pgnlist, int maxpgn);
+int enlist_pgn_node(struct pgn_list *pgnlist, int pgn);
+int delist_pgn_node(struct pgn_list *pgnlist);
+int touch_pgn_node(struct pgn_list *pgnlist, int pgn);
+int remove_pgn_node(struct pgn_list *pgnlist, int pgn);
+int vmap_page_range(struct pcb_t *caller, int addr, int pgnum,
+                    int *frames, int nram, struct vm_rg_struct *ret_rg);
+int vm_map_ram(struct pcb_t *caller, int astart, int send, int mapstart, int incpgnum, struct vm_rg_struct *ret_rg);
+int alloc_pages_range(struct pcb_t *caller, int incpgnum, int *frames, int *nram);
+int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
+                struct memphy_struct *mpdst, int dstfpn) ;
+int swap_cp_bench(int nframes);
+int pte_set_fpn(uint32_t *pte, int fpn);
+int pte_set_swap(uint32_t *pte, int swptyp, int swpoff);
+int pte_set_huge(uint32_t *pte, int fpn);
+int vm_map_huge(struct pcb_t *caller, int pgn, int pgnum);
+int pg_split_huge(struct mm_struct *mm, int pgn);
+int init_pte(uint32_t *pte,
+             int pre,    // present
+             int fpn,    // FPN
+             int drt,    // dirty
+             int swp,    // swap
+             int swptyp, // swap type
+             int swpoff); //swap offset
+int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr);
+int __free(struct pcb_t *caller, int vmaid, int rgid);
+int __read(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE *data);
+int __write(struct pcb_t *caller, int vmaid, int rgid, int offset, BYTE value);
+int init_mm(struct mm_struct *mm, struct pcb_t *caller);
+int copy_mm(struct mm_struct *mm, struct mm_struct *src, struct pcb_t *caller);
+void free_mm_tables(struct mm_struct *mm, struct pcb_t *caller);
+
+/* VM prototypes */
+int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index);
+int pgfree_data(struct pcb_t *proc, uint32_t reg_index);
+int pgfork(struct pcb_t *proc);
+int pgread(
+		struct pcb_t * proc, // Process executing the instruction
+		uint32_t source, // Index of source register
+		uint32_t offset, // Source address = [source] + [offset]
+		uint32_t destination);
+int pgwrite(
+		struct pcb_t * proc, // Process executing the instruction
+		BYTE data, // Data to be wrttien into memory
+		uint32_t destination, // Index of destination register
+		uint32_t offset);
+/* Local VM prototypes */
+struct vm_rg_struct * get_symrg_byid(struct mm_struct* mm, int rgid);
+int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int vmaend);
+int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct *rg_elmt);
+int delete_vm_rg_node(struct vm_rg_struct **list, struct vm_rg_struct *target);
+int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_struct *newrg);
+int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz);
+int find_victim_page(struct pcb_t *caller, struct mm_struct* mm, int *pgn);
+int pg_evict_page(struct mm_struct *mm, int *retfpn, struct pcb_t *caller);
+int pg_alloc_frame(struct mm_struct *mm, int *retfpn, struct pcb_t *caller);
+int set_pgrepl_policy(const char *name);
+void print_pgrepl_stats(void);
+#ifdef MM_WSS_WINDOW
+void print_wss(struct pcb_t *proc);
+#endif
+struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid);
+
+/* MEM/PHY protypes */
+int MEMPHY_get_freefp(struct memphy_struct *mp, int *fpn);
+int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn);
+int MEMPHY_try_freefp_order(struct memphy_struct *mp, int order, int *fpn);
+int MEMPHY_get_freefp_order(struct memphy_struct *mp, int order, int *fpn);
+int MEMPHY_put_freefp_order(struct memphy_struct *mp, int fpn, int order);
+int MEMPHY_read(struct memphy_struct * mp, int addr, BYTE *value);
+int MEMPHY_write(struct memphy_struct * mp, int addr, BYTE data);
+int MEMPHY_ref_frame(struct memphy_struct *mp, int fpn);
+int MEMPHY_unref_frame(struct memphy_struct *mp, int fpn);
+int MEMPHY_get_refcnt(struct memphy_struct *mp, int fpn);
+int MEMPHY_zero_frame(struct memphy_struct *mp, int fpn);
+int MEMPHY_get_frame(struct memphy_struct *mp, int fpn, BYTE *buf);
+int MEMPHY_set_frame(struct memphy_struct *mp, int fpn, BYTE *buf);
+int MEMPHY_cp_frame(struct memphy_struct *mpsrc, int srcfpn,
+                    struct memphy_struct *mpdst, int dstfpn);
+int MEMPHY_dump(struct memphy_struct * mp);
+int MEMPHY_dump_view(const char *path, int seq);
+int MEMPHY_put_usedfp(struct memphy_struct *mp, int fpn);
+int MEMPHY_format(struct memphy_struct *mp, int pagesz);
+int init_memphy(struct memphy_struct *mp, int max_size, int randomflg);
+int init_memphy_file(struct memphy_struct *mp, int max_size, int randomflg, const char *path);
+int init_memphy_nodes(struct memphy_struct *mp, int nnodes, int *nodesz, int randomflg);
+void free_memphy(struct memphy_struct *mp);
+int MEMPHY_get_freefp_node(struct memphy_struct *mp, int nid, int *retfpn);
+int MEMPHY_get_freefp_bulk(struct memphy_struct *mp, int n, int *fpns);
+int MEMPHY_put_freefp_bulk(struct memphy_struct *mp, int n, int *fpns);
+void MEMPHY_bind_cpu(int cpuid);
+int MEMPHY_home_node(struct memphy_struct *mp);
+int MEMPHY_node_of(struct memphy_struct *mp, int fpn);
+void MEMPHY_print_nodes(struct memphy_struct *mp);
+#ifdef MM_MAGAZINE
+int MEMPHY_init_magazines(struct memphy_struct *mp, int ncpu);
+void MEMPHY_print_magazines(struct memphy_struct *mp);
+#endif
+#ifdef MM_SEEK_COST
+int MEMPHY_seek_stall(void);
+#endif
+/* Shared memory prototypes */
+int pgshmget(struct pcb_t *proc, uint32_t key, uint32_t size);
+int pgshmat(struct pcb_t *proc, uint32_t key, uint32_t reg_index);
+int shm_detach(struct pcb_t *caller, int rg_start);
+int shm_exit(struct mm_struct *mm, struct pcb_t *caller);
+int shm_find(struct mm_struct *mm, int pgn);
+int shm_fork(struct mm_struct *mm, struct mm_struct *src, struct pcb_t *child);
+int shm_fault(struct mm_struct *mm, int pgn, struct pcb_t *caller);
+int shm_evict_page(struct pcb_t *caller, int pgn, int fpn);
+/* Swap device prototypes */
+int set_swp_policy(const char *name);
+int swp_get_slot(struct pcb_t *caller, int pgn, int *slot);
+int swp_put_slot(struct pcb_t *caller, int slot);
+struct memphy_struct *swp_dev(struct pcb_t *caller, int slot);
+int swp_write_page(struct pcb_t *caller, int fpn, int slot);
+int swp_read_page(struct pcb_t *caller, int slot, int fpn);
+int swp_cp_slot(struct pcb_t *caller, int srcslot, int dstslot);
+int swp_writeback(struct memphy_struct **mswp);
+void print_swp_stats(struct memphy_struct **mswp);
+/* Same page merging prototypes */
+int ksm_scan(struct pcb_t *caller);
+void ksm_exit(struct pcb_t *proc);
+void ksm_unshare(int fpn, int ref);
+void print_ksm_stats(void);
+/* Background reclaim prototypes */
+void kswapd_register(struct pcb_t *proc);
+void kswapd_unregister(struct pcb_t *proc);
+void *kswapd_routine(void *args);
+void kswapd_stop(void);
+void print_kswapd_stats(void);
+/* NUMA prototypes */
+#ifdef MM_NUMA_REMOTE_COST
+int numa_access(struct pcb_t *caller, int pgn, int fpn);
+int numa_stall(void);
+void print_numa_stats(struct memphy_struct *mram);
+#endif
+/* TLB prototypes */
+int init_tlb(int ncpu);
+void tlb_bind_cpu(int cpuid);
+int tlb_lookup(struct pcb_t *proc, int pgn, int *fpn);
+void tlb_update(struct pcb_t *proc, int pgn, int fpn);
+void tlb_flush_page(uint32_t pid, int pgn);
+void tlb_flush_pid(uint32_t pid);
+void print_tlb_stats(void);
+
+/* DEBUG */
+int print_list_fp(struct framephy_struct *fp);
+int print_list_rg(struct vm_rg_struct *rg);
+int print_list_vma(struct vm_area_struct *rg);
+
+
+int print_list_pgn(struct pgn_list *ip);
+int print_pgtbl(struct pcb_t *ip, uint32_t start, uint32_t end);
+#endif
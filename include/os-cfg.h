@@ -0,0 +1,34 @@
+#ifndef OSCFG_H
+#define OSCFG_H
+
+#define MLQ_SCHED 1
+#define MAX_PRIO 140
+
+#define MM_PAGING
+//#define MM_FIXED_MEMSZ
+#define MM_HUGEPAGE 192 /* touched pages of a block before it is backed huge */
+/* Frames come on first touch. Without it ALLOC maps a region at once with
+ * vm_map_ram, the only user of alloc_pages_range: its buddy blocks, bulk
+ * allocation and whole-region huge pages are dead code while this is on */
+#define MM_DEMAND_PAGING
+#define MM_SWAP_READAHEAD 8 /* widest swap-in window, in pages */
+#define MM_ZSWAP 16384 /* compressed swap pool in front of MEMSWP, in bytes */
+#define MM_KSM 4 /* pages scanned for merging per time slot */
+#define MM_KSWAPD_LOW 5   /* background reclaim below this % of free frames */
+#define MM_KSWAPD_HIGH 10 /* ... and up to this % */
+#define MM_WSS_WINDOW 8 /* working set window, in time slots */
+#define MM_NUMA_REMOTE_COST 1 /* stall time slots per access to another MEMRAM node */
+#define MM_NUMA_MIGRATE 4 /* remote accesses before a page moves to the local node */
+#define MM_MAGAZINE 8 /* frames a CPU moves between its cache and MEMRAM at once */
+#define MM_SEEK_COST 4096 /* bytes a sequential device cursor travels per stall time slot */
+//#define MM_SWP_SEQUENTIAL
+#define MM_MMAP_STORAGE /* MEMPHY storage mapped, untouched frames cost no host memory */
+//#define MM_SWP_FILE "MEMSWP" /* keep MEMSWP device i in file MEMSWP<i>, needs MM_MMAP_STORAGE */
+//#define VMDBG 1
+#define MMDBG 1
+#define IODUMP 1
+#define PAGETBL_DUMP 1
+
+#define OUTPUT_FOLDER "output/"
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef OSMM_H
+#define OSMM_H
+
+#include <string.h>
+#include <sys/types.h>
+
+#define MM_PAGING
+#define PAGING_MAX_MMSWP 4 /* max number of supported swapped space */
+#define PAGING_MAX_SYMTBL_SZ 30
+
+typedef char BYTE;
+typedef uint32_t addr_t;
+//typedef unsigned int uint32_t;
+
+/*
+ *  Page replacement list, intrusive over page numbers: every pgn owns
+ *  one pg_next/pg_prev slot so no node is allocated per page.
+ *  head is the oldest page, tail the newest, -1 ends the list.
+ *  hand and pg_age are the CLOCK and aging LRU policy state.
+ */
+struct pgn_list {
+   int head;
+   int tail;
+   int count;
+   int hand;
+   int *pg_next;
+   int *pg_prev;
+   uint8_t *pg_age;
+};
+
+/*
+ *  Memory region struct
+ */
+struct vm_rg_struct {
+   unsigned long rg_start;
+   unsigned long rg_end;
+
+   struct vm_rg_struct *rg_next;
+};
+
+/*
+ *  Memory area struct
+ */
+struct vm_area_struct {
+   unsigned long vm_id;
+   unsigned long vm_start;
+   unsigned long vm_end;
+
+   unsigned long sbrk;
+/*
+ * Derived field
+ * unsigned long vm_limit = vm_end - vm_start
+ */
+   struct mm_struct *vm_mm;
+   struct vm_rg_struct *vm_freerg_list;
+   struct vm_area_struct *vm_next;
+};
+
+/* 
+ * Memory management struct
+ */
+struct mm_struct {
+   uint32_t *pgd;
+
+   struct vm_area_struct *mmap;
+
+   /* Currently we support a fixed number of symbol */
+   struct vm_rg_struct symrgtbl[PAGING_MAX_SYMTBL_SZ];
+
+   /* list of on-line pages, in replacement order */
+   struct pgn_list fifo_pgn;
+
+   /* per pgn swap slot still holding a copy of the on-line page, or -1 */
+   int *swp_slot;
+
+   /* shared memory segments attached to this address space */
+   struct shm_attach_struct *shm_list;
+
+   /* next page the same page merging scan looks at */
+   int ksm_cursor;
+
+   /* held by the CPU running the owner, reclaim skips a busy mm */
+   pthread_mutex_t mm_lock;
+
+   /* per pgn time of the last access plus one, 0 if never used */
+   uint32_t *pg_atime;
+
+   /* on-line huge pages, each one replacement list entry for
+    * PAGING_HUGE_NPAGES frames */
+   int nhuge;
+
+   /* frames allowed before replacing its own, 0 unlimited */
+   int rss_limit;
+
+   /* largest working set sampled */
+   int wss_peak;
+};
+
+/*
+ * Shared memory segment, its pages live in MEMRAM or in one swap slot
+ * whichever process faulted them last
+ */
+struct shm_struct {
+   uint32_t key;
+   int npages;
+
+   /* per page frame in MEMRAM and swap slot, -1 if none */
+   int *fpn;
+   int *swpslot;
+
+   /* reverse map, every attachment of the segment */
+   struct shm_attach_struct *rmap;
+   struct shm_struct *shm_next;
+};
+
+struct shm_attach_struct {
+   struct shm_struct *shm;
+   struct mm_struct *mm;
+   uint32_t pid;
+   int pgn; /* first page of the mapping */
+
+   struct shm_attach_struct *att_next;  /* next segment of the same mm */
+   struct shm_attach_struct *rmap_next; /* next mapper of the same segment */
+};
+
+/*
+ * FRAME/MEM PHY struct
+ */
+struct framephy_struct { 
+   int fpn;
+   struct framephy_struct *fp_next;
+
+   /* Resereed for tracking allocated framed */
+   struct mm_struct* owner;
+};
+
+/*
+ * Node of a MEMPHY device, a range of its frames with an allocator of
+ * its own. Nodes start on a frame map word so no word is shared.
+ */
+struct memphy_node {
+   int start_fp;
+   int end_fp;
+   int free_fp_cnt;
+   int fp_hint;
+
+   /* frames handed to CPUs of this node and to CPUs of other nodes */
+   unsigned long alloc_local;
+   unsigned long alloc_remote;
+
+   pthread_mutex_t lock;
+};
+
+struct memphy_struct {
+   /* Basic field of data and size */
+   BYTE *storage;
+   int maxsz;
+   int storage_shared; /* storage maps a file, see init_memphy_file */
+   
+   /* Sequential device fields */ 
+   int rdmflg;
+   int cursor;
+   unsigned long seek_bytes; /* distance the cursor travelled */
+
+   /* Device lock: the cursor of a sequential device and dumps. Bytes of
+    * a random access frame belong to whoever maps it, the allocator
+    * state to the lock of its node */
+   pthread_mutex_t lock;
+
+   /* Management structure
+    * fp_map     : one bit per frame, set when the frame is taken
+    * fp_summary : one bit per fp_map word, set when that word is full
+    * used_fp_map: one bit per frame, set when the frame holds live data
+    * dirty_fp_map: one bit per frame, set when it changed since the last dump
+    */
+   int maxfp;
+   int free_fp_cnt;
+   uint64_t *fp_map;
+   uint64_t *fp_summary;
+   uint64_t *used_fp_map;
+   uint64_t *dirty_fp_map;
+
+   /* Frames split in nodes, a single one for all but a NUMA MEMRAM */
+   int nnodes;
+   struct memphy_node *nodes;
+
+   /* Per CPU caches of free frames, see MEMPHY_init_magazines. A frame
+    * cached has its cached_fp_map bit set, its fp_map bit stays taken */
+   struct memphy_magazine *mags;
+   uint64_t *cached_fp_map;
+   int nmags;
+   int mag_batch;
+
+   /* Number of PTEs sharing each frame, 0 for a private frame */
+   int *fp_refcnt;
+
+   /* Accesses from CPUs of other nodes since the frame was taken */
+   int *fp_remote;
+
+   /* Dump file, open from the first dump on, see MEMPHY_dump */
+   FILE *file;
+   uint32_t dump_seq;
+};
+
+#endif
@@ -0,0 +1,393 @@
+
+#include "checkpoint.h"
+#include "loader.h"
+#include "timer.h"
+#include "mm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * A checkpoint is one file, written between two time slots while the
+ * CPUs, the loader and kswapd all wait for the timer. In order:
+ *   header, CPU states, every live process with its mm, scheduler
+ *   queues, shared segments, MEMRAM and the MEMSWP devices.
+ * Words are in host order, the same build reads it back. Replacement
+ * and swap policies, TLBs and statistics are not saved, a restored run
+ * starts them afresh and may pick other policies.
+ */
+struct ckpt_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t time;
+	uint32_t pagesz;
+	uint32_t max_pgn;
+	int32_t num_cpus;
+	int32_t num_processes;
+	int32_t npcb;
+	uint32_t avail_pid;
+	int32_t ld_next;
+	uint32_t ld_pending; // PID, 0 if none
+};
+
+struct ckpt_pcb {
+	uint32_t pid;
+	uint32_t priority;
+	uint32_t prio;
+	uint32_t pc;
+	uint32_t bp;
+	uint32_t code_size;
+	int32_t has_mm;
+	addr_t regs[10];
+};
+
+/* Processes restored so far, PIDs in the file resolve against them */
+static struct pcb_t ** ckpt_pcbs;
+static int ckpt_npcb;
+
+/* Set by a short write or a failed seek, checkpoint_save then fails.
+ * A seek does not set the error flag of the stream */
+static int ckpt_write_failed;
+
+void ckpt_write(FILE * file, const void * buf, size_t len) {
+	if (fwrite(buf, 1, len, file) != len) {
+		ckpt_write_failed = 1;
+	}
+}
+
+void ckpt_write_align(FILE * file) {
+	long pos = ftell(file);
+	/* Leave a hole, the file stays sparse */
+	if (pos < 0 ||
+	    fseek(file, (CKPT_ALIGN - pos % CKPT_ALIGN) % CKPT_ALIGN, SEEK_CUR) != 0) {
+		ckpt_write_failed = 1;
+	}
+}
+
+/* Write [len] bytes of device storage, zero host pages become holes */
+void ckpt_write_sparse(FILE * file, const BYTE * buf, size_t len) {
+	static const BYTE zero[CKPT_ALIGN];
+	size_t off, chunk;
+	for (off = 0; off < len; off += chunk) {
+		chunk = (len - off < CKPT_ALIGN) ? len - off : CKPT_ALIGN;
+		if (!memcmp(buf + off, zero, chunk)) {
+			if (fseek(file, chunk, SEEK_CUR) != 0) {
+				ckpt_write_failed = 1;
+			}
+		}else{
+			ckpt_write(file, buf + off, chunk);
+		}
+	}
+}
+
+int ckpt_read(struct ckpt_image * img, void * buf, size_t len) {
+	if (img->off + len > img->size) {
+		return -1;
+	}
+	memcpy(buf, img->base + img->off, len);
+	img->off += len;
+	return 0;
+}
+
+int ckpt_read_align(struct ckpt_image * img) {
+	img->off = (img->off + CKPT_ALIGN - 1) / CKPT_ALIGN * CKPT_ALIGN;
+	return (img->off <= img->size) ? 0 : -1;
+}
+
+struct pcb_t * ckpt_find_pcb(uint32_t pid) {
+	int i;
+	for (i = 0; i < ckpt_npcb; i++) {
+		if (ckpt_pcbs[i]->pid == pid) {
+			return ckpt_pcbs[i];
+		}
+	}
+	return NULL;
+}
+
+static int ckpt_open(struct ckpt_image * img, const char * path) {
+	struct stat st;
+	if ((img->fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if (fstat(img->fd, &st) != 0 || st.st_size == 0) {
+		close(img->fd);
+		return -1;
+	}
+	img->size = st.st_size;
+	img->off = 0;
+	img->base = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, img->fd, 0);
+	if (img->base == MAP_FAILED) {
+		close(img->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void ckpt_close(struct ckpt_image * img) {
+	munmap(img->base, img->size);
+	close(img->fd);
+}
+
+static void ckpt_save_pcb(FILE * file, struct pcb_t * proc) {
+	struct ckpt_pcb rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.pid = proc->pid;
+	rec.priority = proc->priority;
+#ifdef MLQ_SCHED
+	rec.prio = proc->prio;
+#endif
+	rec.pc = proc->pc;
+	rec.bp = proc->bp;
+	rec.code_size = proc->code->size;
+#ifdef MM_PAGING
+	rec.has_mm = (proc->mm != NULL);
+#endif
+	memcpy(rec.regs, proc->regs, sizeof(rec.regs));
+
+	ckpt_write(file, &rec, sizeof(rec));
+	ckpt_write(file, proc->code->text, proc->code->size * sizeof(struct inst_t));
+#ifdef MM_PAGING
+	if (rec.has_mm) {
+		mm_save(file, proc->mm);
+	}
+#endif
+}
+
+/* Free a PCB restored from a checkpoint that could not be completed */
+static void ckpt_free_pcb(struct pcb_t * proc) {
+#ifdef MM_PAGING
+	if (proc->mm != NULL) {
+		shm_exit(proc->mm, NULL);
+		free_mm_tables(proc->mm, NULL);
+		free(proc->mm);
+	}
+#endif
+	free(proc->code->text);
+	free(proc->code);
+	free(proc->page_table);
+	free(proc);
+}
+
+static struct pcb_t * ckpt_restore_pcb(struct ckpt_image * img, struct ckpt_os * os) {
+	struct pcb_t * proc;
+	struct ckpt_pcb rec;
+
+	if (ckpt_read(img, &rec, sizeof(rec)) != 0) {
+		return NULL;
+	}
+
+	proc = (struct pcb_t *)calloc(1, sizeof(struct pcb_t));
+	proc->pid = rec.pid;
+	proc->priority = rec.priority;
+#ifdef MLQ_SCHED
+	proc->prio = rec.prio;
+#endif
+	proc->pc = rec.pc;
+	proc->bp = rec.bp;
+	memcpy(proc->regs, rec.regs, sizeof(rec.regs));
+	proc->page_table =
+		(struct page_table_t*)malloc(sizeof(struct page_table_t));
+
+	proc->code = (struct code_seg_t*)malloc(sizeof(struct code_seg_t));
+	proc->code->size = rec.code_size;
+	proc->code->text = (struct inst_t*)malloc(
+		sizeof(struct inst_t) * rec.code_size
+	);
+	if (ckpt_read(img, proc->code->text, rec.code_size * sizeof(struct inst_t)) != 0) {
+		ckpt_free_pcb(proc);
+		return NULL;
+	}
+
+#ifdef MM_PAGING
+	/* A process still waiting for its start time gets its mm from the loader */
+	if (rec.has_mm) {
+		proc->mm = malloc(sizeof(struct mm_struct));
+		if (mm_restore(img, proc->mm) != 0) {
+			free(proc->mm);
+			proc->mm = NULL;
+			ckpt_free_pcb(proc);
+			return NULL;
+		}
+		proc->mram = os->mram;
+		proc->mswp = os->mswp;
+		proc->active_mswp = os->mswp[0];
+	}
+#endif
+	return proc;
+}
+
+/*
+ * checkpoint_save - write the whole simulation to [path]
+ * Called by the timer between two time slots, nothing else runs.
+ */
+int checkpoint_save(const char * path, struct ckpt_os * os) {
+	FILE * file = fopen(path, "wb");
+	struct ckpt_header hdr;
+	struct pcb_t ** procs;
+	int32_t cpu[4];
+	int npcb = 0, nqueued, i, ret;
+
+	if (file == NULL) {
+		return -1;
+	}
+	ckpt_write_failed = 0;
+
+	/* Every live process: on a CPU, queued, or held by the loader */
+	nqueued = sched_procs(NULL, 0);
+	procs = malloc((nqueued + os->num_cpus + 1) * sizeof(struct pcb_t *));
+	for (i = 0; i < os->num_cpus; i++) {
+		if (os->cpus[i].proc != NULL) {
+			procs[npcb++] = os->cpus[i].proc;
+		}
+	}
+	npcb += sched_procs(procs + npcb, nqueued);
+	if (os->ld_pending != NULL) {
+		procs[npcb++] = os->ld_pending;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CKPT_MAGIC;
+	hdr.version = CKPT_VERSION;
+	hdr.time = current_time();
+	hdr.pagesz = PAGING_PAGESZ;
+	hdr.max_pgn = PAGING_MAX_PGN;
+	hdr.num_cpus = os->num_cpus;
+	hdr.num_processes = os->num_processes;
+	hdr.npcb = npcb;
+	hdr.avail_pid = get_avail_pid();
+	hdr.ld_next = os->ld_next;
+	hdr.ld_pending = (os->ld_pending != NULL) ? os->ld_pending->pid : 0;
+	ckpt_write(file, &hdr, sizeof(hdr));
+
+	for (i = 0; i < os->num_cpus; i++) {
+		cpu[0] = (os->cpus[i].proc != NULL) ? os->cpus[i].proc->pid : 0;
+		cpu[1] = os->cpus[i].time_left;
+		cpu[2] = os->cpus[i].stall;
+		cpu[3] = os->cpus[i].stopped;
+		ckpt_write(file, cpu, sizeof(cpu));
+	}
+
+	for (i = 0; i < npcb; i++) {
+		ckpt_save_pcb(file, procs[i]);
+	}
+	sched_save(file);
+
+#ifdef MM_PAGING
+	shm_save(file);
+	/* Pages only kept compressed go to their slots first */
+	swp_writeback(os->mswp);
+	MEMPHY_save(file, os->mram);
+	for (i = 0; i < PAGING_MAX_MMSWP; i++) {
+		MEMPHY_save(file, os->mswp[i]);
+	}
+#endif
+
+	/* Storage ending in untouched pages left a hole at the end */
+	ret = (ckpt_write_failed || fflush(file) != 0 || ferror(file) ||
+	       ftruncate(fileno(file), ftell(file)) != 0) ? -1 : 0;
+	if (fclose(file) != 0) {
+		ret = -1;
+	}
+	free(procs);
+	return ret;
+}
+
+/*
+ * checkpoint_restore - load the simulation saved in [path]
+ * The config and the devices must be the same as when it was saved.
+ * Called before any thread starts, [os] receives the CPU and loader
+ * state, everything else goes back to its module.
+ */
+int checkpoint_restore(const char * path, struct ckpt_os * os) {
+	struct ckpt_image img;
+	struct ckpt_header hdr;
+	int32_t * cpus = NULL;
+#if defined(MM_PAGING) && defined(MM_KSWAPD_LOW)
+	struct pcb_t * prev, * next;
+#endif
+	int i, ret = -1;
+
+	if (ckpt_open(&img, path) != 0) {
+		return -1;
+	}
+
+	if (ckpt_read(&img, &hdr, sizeof(hdr)) != 0 || hdr.magic != CKPT_MAGIC ||
+	    hdr.version != CKPT_VERSION || hdr.pagesz != PAGING_PAGESZ ||
+	    hdr.max_pgn != PAGING_MAX_PGN || hdr.num_cpus != os->num_cpus ||
+	    hdr.num_processes != os->num_processes) {
+		goto out;
+	}
+
+	cpus = malloc(4 * sizeof(int32_t) * os->num_cpus);
+	if (ckpt_read(&img, cpus, 4 * sizeof(int32_t) * os->num_cpus) != 0) {
+		goto out;
+	}
+
+	ckpt_pcbs = malloc(hdr.npcb * sizeof(struct pcb_t *));
+	for (ckpt_npcb = 0; ckpt_npcb < hdr.npcb; ckpt_npcb++) {
+		if ((ckpt_pcbs[ckpt_npcb] = ckpt_restore_pcb(&img, os)) == NULL) {
+			goto out;
+		}
+	}
+
+	for (i = 0; i < os->num_cpus; i++) {
+		os->cpus[i].proc = cpus[4 * i] ? ckpt_find_pcb(cpus[4 * i]) : NULL;
+		os->cpus[i].time_left = cpus[4 * i + 1];
+		os->cpus[i].stall = cpus[4 * i + 2];
+		os->cpus[i].stopped = cpus[4 * i + 3];
+	}
+	os->ld_next = hdr.ld_next;
+	os->ld_pending = hdr.ld_pending ? ckpt_find_pcb(hdr.ld_pending) : NULL;
+
+	if (sched_restore(&img) != 0) {
+		goto out;
+	}
+
+#ifdef MM_PAGING
+	if (shm_restore(&img) != 0 || MEMPHY_restore(&img, os->mram) != 0) {
+		goto out;
+	}
+	for (i = 0; i < PAGING_MAX_MMSWP; i++) {
+		if (MEMPHY_restore(&img, os->mswp[i]) != 0) {
+			goto out;
+		}
+	}
+#ifdef MM_KSWAPD_LOW
+	/* By increasing PID, the order they were loaded or forked in */
+	for (prev = NULL; ; prev = next) {
+		next = NULL;
+		for (i = 0; i < ckpt_npcb; i++) {
+			if (ckpt_pcbs[i]->mm != NULL &&
+			    (prev == NULL || ckpt_pcbs[i]->pid > prev->pid) &&
+			    (next == NULL || ckpt_pcbs[i]->pid < next->pid)) {
+				next = ckpt_pcbs[i];
+			}
+		}
+		if (next == NULL) {
+			break;
+		}
+		kswapd_register(next);
+	}
+#endif
+#endif
+
+	set_avail_pid(hdr.avail_pid);
+	set_time(hdr.time);
+	ret = 0;
+out:
+	/* The PCBs were only looked up by PID while restoring */
+	for (i = 0; ret != 0 && i < ckpt_npcb; i++) {
+		ckpt_free_pcb(ckpt_pcbs[i]);
+	}
+	free(ckpt_pcbs);
+	ckpt_pcbs = NULL;
+	ckpt_npcb = 0;
+	free(cpus);
+	ckpt_close(&img);
+	return ret;
+}
@@ -0,0 +1,168 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Software TLB per simulated CPU cpu-tlb.c
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ *  Direct mapped, tagged with (pid, pgn) so a context switch needs no
+ *  flush. Other CPUs only touch a TLB to shoot an entry down, the lock
+ *  is uncontended on the lookup path.
+ */
+struct tlb_entry_struct {
+  int valid;
+  uint32_t pid;
+  int pgn;
+  int fpn;
+};
+
+struct tlb_struct {
+  struct tlb_entry_struct entry[TLB_NENTRY];
+  unsigned long hit;
+  unsigned long miss;
+  pthread_mutex_t lock;
+};
+
+static struct tlb_struct *tlbs;
+static int tlb_ncpu;
+static __thread int tlb_cpu = -1;
+
+#define TLB_INDEX(pid, pgn) (((pgn) ^ ((pid) * 7)) % TLB_NENTRY)
+
+/*
+ *  init_tlb - create one empty TLB per CPU
+ *  @ncpu: number of simulated CPUs
+ */
+int init_tlb(int ncpu)
+{
+  int cit;
+
+  tlbs = calloc(ncpu, sizeof(struct tlb_struct));
+  tlb_ncpu = ncpu;
+
+  for (cit = 0; cit < ncpu; cit++)
+    pthread_mutex_init(&tlbs[cit].lock, NULL);
+
+  return 0;
+}
+
+/*
+ *  tlb_bind_cpu - make the calling CPU thread use TLB @cpuid
+ */
+void tlb_bind_cpu(int cpuid)
+{
+  if (cpuid >= 0 && cpuid < tlb_ncpu)
+    tlb_cpu = cpuid;
+}
+
+/*
+ *  tlb_lookup - translate pgn of proc on the current CPU
+ *  @proc: process owning the address space
+ *  @pgn: PGN
+ *  @fpn: return FPN on hit
+ *  return 0 on hit, -1 on miss
+ */
+int tlb_lookup(struct pcb_t *proc, int pgn, int *fpn)
+{
+  struct tlb_struct *tlb;
+  struct tlb_entry_struct *ent;
+  int ret = -1;
+
+  if (tlb_cpu < 0)
+    return -1;
+
+  tlb = &tlbs[tlb_cpu];
+  ent = &tlb->entry[TLB_INDEX(proc->pid, pgn)];
+
+  pthread_mutex_lock(&tlb->lock);
+  if (ent->valid && ent->pid == proc->pid && ent->pgn == pgn)
+  {
+    *fpn = ent->fpn;
+    tlb->hit++;
+    ret = 0;
+  }
+  else
+    tlb->miss++;
+  pthread_mutex_unlock(&tlb->lock);
+
+  return ret;
+}
+
+/*
+ *  tlb_update - cache a translation on the current CPU
+ */
+void tlb_update(struct pcb_t *proc, int pgn, int fpn)
+{
+  struct tlb_struct *tlb;
+  struct tlb_entry_struct *ent;
+
+  if (tlb_cpu < 0)
+    return;
+
+  tlb = &tlbs[tlb_cpu];
+  ent = &tlb->entry[TLB_INDEX(proc->pid, pgn)];
+
+  pthread_mutex_lock(&tlb->lock);
+  ent->valid = 1;
+  ent->pid = proc->pid;
+  ent->pgn = pgn;
+  ent->fpn = fpn;
+  pthread_mutex_unlock(&tlb->lock);
+}
+
+/*
+ *  tlb_flush_page - drop the translation of (pid, pgn) from every CPU
+ */
+void tlb_flush_page(uint32_t pid, int pgn)
+{
+  struct tlb_entry_struct *ent;
+  int cit;
+
+  for (cit = 0; cit < tlb_ncpu; cit++)
+  {
+    ent = &tlbs[cit].entry[TLB_INDEX(pid, pgn)];
+
+    pthread_mutex_lock(&tlbs[cit].lock);
+    if (ent->valid && ent->pid == pid && ent->pgn == pgn)
+      ent->valid = 0;
+    pthread_mutex_unlock(&tlbs[cit].lock);
+  }
+}
+
+/*
+ *  tlb_flush_pid - drop every translation of pid from every CPU
+ */
+void tlb_flush_pid(uint32_t pid)
+{
+  int cit, eit;
+
+  for (cit = 0; cit < tlb_ncpu; cit++)
+  {
+    pthread_mutex_lock(&tlbs[cit].lock);
+    for (eit = 0; eit < TLB_NENTRY; eit++)
+      if (tlbs[cit].entry[eit].pid == pid)
+        tlbs[cit].entry[eit].valid = 0;
+    pthread_mutex_unlock(&tlbs[cit].lock);
+  }
+}
+
+void print_tlb_stats(void)
+{
+  unsigned long hit, miss;
+  int cit;
+
+  for (cit = 0; cit < tlb_ncpu; cit++)
+  {
+    hit = tlbs[cit].hit;
+    miss = tlbs[cit].miss;
+    printf("TLB CPU %d: %lu hits %lu misses (%.1f%% hit rate)\n", cit, hit, miss,
+           (hit + miss) ? 100.0 * hit / (hit + miss) : 0.0);
+  }
+}
+
+// #endif
@@ -98,6 +98,25 @@ int run(struct pcb_t * proc) {
 
 #else
 		stat = write(proc, ins.arg_0, ins.arg_1, ins.arg_2);
+#endif
+		break;
+	case FORK:
+#ifdef MM_PAGING
+		/* fork */
+		stat = pgfork(proc);
+#endif
+		break;
+	case SHMGET:
+#ifdef MM_PAGING
+		/* shmget [key] [size] */
+		stat = pgshmget(proc, ins.arg_0, ins.arg_1);
+#endif
+		break;
+	case SHMAT:
+#ifdef MM_PAGING
+		/* shmat [key] [reg] */
+		stat = pgshmat(proc, ins.arg_0, ins.arg_1);
+		print_pgtbl(proc,0,-1);
 #endif
 		break;
 	default:
@@ -11,6 +11,9 @@ static uint32_t avail_pid = 1;
 #define OPT_FREE	"free"
 #define OPT_READ	"read"
 #define OPT_WRITE	"write"
+#define OPT_FORK	"fork"
+#define OPT_SHMGET	"shmget"
+#define OPT_SHMAT	"shmat"
 
 static enum ins_opcode_t get_opcode(char * opt) {
 	if (!strcmp(opt, OPT_CALC)) {
@@ -23,17 +26,41 @@ static enum ins_opcode_t get_opcode(char * opt) {
 		return READ;
 	}else if (!strcmp(opt, OPT_WRITE)) {
 		return WRITE;
+	}else if (!strcmp(opt, OPT_FORK)) {
+		return FORK;
+	}else if (!strcmp(opt, OPT_SHMGET)) {
+		return SHMGET;
+	}else if (!strcmp(opt, OPT_SHMAT)) {
+		return SHMAT;
 	}else{
 		printf("Opcode: %s\n", opt);
 		exit(1);
 	}
 }
 
+struct pcb_t * clone_pcb(struct pcb_t * proc) {
+	struct pcb_t * child = (struct pcb_t * )malloc(sizeof(struct pcb_t));
+
+	/* Same code segment and registers, continue after the fork */
+	*child = *proc;
+	child->pid = __sync_fetch_and_add(&avail_pid, 1);
+	child->page_table =
+		(struct page_table_t*)malloc(sizeof(struct page_table_t));
+	return child;
+}
+
+uint32_t get_avail_pid(void) {
+	return avail_pid;
+}
+
+void set_avail_pid(uint32_t pid) {
+	avail_pid = pid;
+}
+
 struct pcb_t * load(const char * path) {
 	/* Create new PCB for the new process */
 	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
-	proc->pid = avail_pid;
-	avail_pid++;
+	proc->pid = __sync_fetch_and_add(&avail_pid, 1);
 	proc->page_table =
 		(struct page_table_t*)malloc(sizeof(struct page_table_t));
 	proc->bp = PAGE_SIZE;
@@ -57,8 +84,11 @@ struct pcb_t * load(const char * path) {
 		proc->code->text[i].opcode = get_opcode(opcode);
 		switch(proc->code->text[i].opcode) {
 		case CALC:
+		case FORK:
 			break;
 		case ALLOC:
+		case SHMGET:
+		case SHMAT:
 			fscanf(
 				file,
 				"%u %u\n",
@@ -0,0 +1,219 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Same page merging mm-ksm.c
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef MM_KSM
+/*
+ *  Each CPU scans a few pages of the process it runs after every time
+ *  slot. A page is hashed and looked up among the pages seen so far, an
+ *  identical one gets both PTEs on a single frame copy-on-write, the
+ *  same sharing FORK sets up. A later write simply breaks it again.
+ */
+struct ksm_entry {
+  struct mm_struct *mm;
+  uint32_t pid;
+  int pgn;
+  int fpn;
+  uint32_t hash;
+};
+
+static struct ksm_entry ksm_tbl[KSM_NBUCKET];
+static pthread_mutex_t ksm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long ksm_pages_shared;
+static unsigned long ksm_pages_sharing;
+static unsigned long ksm_pages_scanned;
+
+/* Pages merged onto each frame and still on it, sized on the first merge */
+static int *ksm_fp_sharing;
+
+static uint32_t ksm_hash(BYTE *page)
+{
+  uint32_t hash = 2166136261u;
+  int bit;
+
+  for (bit = 0; bit < PAGING_PAGESZ; bit++)
+    hash = (hash ^ (unsigned char)page[bit]) * 16777619u;
+
+  return hash;
+}
+
+/* Only a private, on-line base page can be merged */
+static int ksm_mergeable(struct mm_struct *mm, int pgn)
+{
+  uint32_t pte = mm->pgd[pgn];
+
+  if (!PAGING_PAGE_PRESENT(pte) || PAGING_PAGE_HUGE(pte))
+    return 0;
+#ifdef MM_HUGEPAGE
+  if (PAGING_PAGE_HUGE(mm->pgd[PAGING_HUGE_PGN(pgn)]))
+    return 0;
+#endif
+
+  return !shm_find(mm, pgn);
+}
+
+/*
+ *  ksm_merge - put @pgn of @caller on the frame of entry @ent
+ *  ksm_lock and the mm_lock of both processes held, both pages were
+ *  found identical.
+ */
+static void ksm_merge(struct pcb_t *caller, int pgn, struct ksm_entry *ent)
+{
+  struct mm_struct *mm = caller->mm;
+  int oldfpn = PAGING_FPN(mm->pgd[pgn]);
+
+  if (ksm_fp_sharing == NULL)
+    ksm_fp_sharing = calloc(caller->mram->maxfp, sizeof(int));
+
+  /* The first merge onto a frame makes it a shared one */
+  SETBIT(ent->mm->pgd[ent->pgn], PAGING_PTE_COW_MASK);
+  if (ksm_fp_sharing[ent->fpn]++ == 0)
+    ksm_pages_shared++;
+  MEMPHY_ref_frame(caller->mram, ent->fpn);
+
+  pte_set_fpn(&mm->pgd[pgn], ent->fpn);
+  SETBIT(mm->pgd[pgn], PAGING_PTE_COW_MASK);
+  tlb_flush_page(caller->pid, pgn);
+
+  /* The page is clean now, a swap copy of its old frame may be stale */
+  if (mm->swp_slot[pgn] >= 0)
+  {
+    swp_put_slot(caller, mm->swp_slot[pgn]);
+    mm->swp_slot[pgn] = -1;
+  }
+
+  /* A COW frame left by FORK loses one sharer, a private one is free */
+  if (MEMPHY_get_refcnt(caller->mram, oldfpn) > 1)
+    MEMPHY_unref_frame(caller->mram, oldfpn);
+  else
+    MEMPHY_put_freefp(caller->mram, oldfpn);
+
+  ksm_pages_sharing++;
+}
+
+/*
+ *  ksm_scan - look at the next KSM pages of the running process
+ *  @caller: process the CPU just ran
+ */
+int ksm_scan(struct pcb_t *caller)
+{
+  struct mm_struct *mm = caller->mm;
+  struct vm_area_struct *cur_vma = get_vma_by_num(mm, 0);
+  BYTE page[PAGING_PAGESZ], other[PAGING_PAGESZ];
+  struct ksm_entry *ent;
+  struct mm_struct *entmm;
+  int npg, nscan, pgn, fpn;
+  uint32_t hash;
+
+  if (cur_vma == NULL || (npg = PAGING_PGN(cur_vma->vm_end)) == 0)
+    return 0;
+
+  for (nscan = 0; nscan < MM_KSM; nscan++)
+  {
+    pgn = mm->ksm_cursor++ % npg;
+    if (!ksm_mergeable(mm, pgn))
+      continue;
+
+    fpn = PAGING_FPN(mm->pgd[pgn]);
+    if (MEMPHY_get_refcnt(caller->mram, fpn) > 1 || PAGING_PAGE_COW(mm->pgd[pgn]))
+      continue; /* shared already */
+
+    MEMPHY_get_frame(caller->mram, fpn, page);
+    hash = ksm_hash(page);
+
+    pthread_mutex_lock(&ksm_lock);
+    ksm_pages_scanned++;
+    ent = &ksm_tbl[hash % KSM_NBUCKET];
+
+    /* The PTEs of a process running on another CPU are left alone */
+    entmm = ent->mm;
+    if (entmm != NULL && entmm != mm &&
+        pthread_mutex_trylock(&entmm->mm_lock) != 0)
+    {
+      pthread_mutex_unlock(&ksm_lock);
+      continue;
+    }
+
+    /* The page seen before must still be where it was */
+    if (ent->mm != NULL && ent->hash == hash && ent->fpn != fpn &&
+        PAGING_PAGE_PRESENT(ent->mm->pgd[ent->pgn]) &&
+        PAGING_FPN(ent->mm->pgd[ent->pgn]) == ent->fpn &&
+        MEMPHY_get_frame(caller->mram, ent->fpn, other) == 0 &&
+        !memcmp(page, other, PAGING_PAGESZ))
+      ksm_merge(caller, pgn, ent);
+    else
+    {
+      ent->mm = mm;
+      ent->pid = caller->pid;
+      ent->pgn = pgn;
+      ent->fpn = fpn;
+      ent->hash = hash;
+    }
+    if (entmm != NULL && entmm != mm)
+      pthread_mutex_unlock(&entmm->mm_lock);
+    pthread_mutex_unlock(&ksm_lock);
+  }
+
+  return 0;
+}
+
+/*
+ *  ksm_exit - forget the pages seen of exiting process @proc
+ */
+void ksm_exit(struct pcb_t *proc)
+{
+  int bucket;
+
+  pthread_mutex_lock(&ksm_lock);
+  for (bucket = 0; bucket < KSM_NBUCKET; bucket++)
+    if (ksm_tbl[bucket].mm == proc->mm)
+      ksm_tbl[bucket].mm = NULL;
+  pthread_mutex_unlock(&ksm_lock);
+}
+
+/*
+ *  ksm_unshare - account a PTE that left frame @fpn
+ *  @fpn: frame number
+ *  @ref: sharers left, as returned by MEMPHY_unref_frame
+ *
+ *  Called after a COW break, a swap out or an exit. A merged page only
+ *  stops counting once the frame has fewer sharers than merges, FORK
+ *  sharing is not KSM's.
+ */
+void ksm_unshare(int fpn, int ref)
+{
+  int left = (ref > 1) ? ref - 1 : 0;
+
+  if (ksm_fp_sharing == NULL || fpn < 0 || ksm_fp_sharing[fpn] <= left)
+    return;
+
+  pthread_mutex_lock(&ksm_lock);
+  while (ksm_fp_sharing[fpn] > left)
+  {
+    ksm_pages_sharing--;
+    if (--ksm_fp_sharing[fpn] == 0)
+      ksm_pages_shared--;
+  }
+  pthread_mutex_unlock(&ksm_lock);
+}
+
+/*
+ *  print_ksm_stats - report the merged pages
+ */
+void print_ksm_stats(void)
+{
+  printf("Same page merging: %lu pages scanned, %lu pages shared, %lu pages sharing\n",
+         ksm_pages_scanned, ksm_pages_shared, ksm_pages_sharing);
+}
+#endif
+
+// #endif
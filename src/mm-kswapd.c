@@ -0,0 +1,156 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Background page reclaim mm-kswapd.c
+ */
+
+#include "mm.h"
+#include "timer.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef MM_KSWAPD_LOW
+/*
+ *  A timer device of its own. Once per time slot it looks at the free
+ *  frames of MEMRAM, below the low watermark it evicts cold pages until
+ *  the high one is reached. The victims come from processes that are
+ *  not on a CPU, their mm_lock is free, round-robin over the processes.
+ */
+struct kswapd_proc {
+  struct pcb_t *proc;
+  struct kswapd_proc *next;
+};
+
+static struct kswapd_proc *kswapd_procs;
+static struct kswapd_proc *kswapd_next;
+static pthread_mutex_t kswapd_lock = PTHREAD_MUTEX_INITIALIZER;
+static int kswapd_stopped;
+
+static unsigned long kswapd_wakeups;
+static unsigned long kswapd_reclaimed;
+
+/*
+ *  kswapd_register - make a process a candidate for reclaim
+ */
+void kswapd_register(struct pcb_t *proc)
+{
+  struct kswapd_proc *kp = malloc(sizeof(struct kswapd_proc));
+
+  kp->proc = proc;
+  pthread_mutex_lock(&kswapd_lock);
+  kp->next = kswapd_procs;
+  kswapd_procs = kp;
+  pthread_mutex_unlock(&kswapd_lock);
+}
+
+/*
+ *  kswapd_unregister - forget an exiting process
+ */
+void kswapd_unregister(struct pcb_t *proc)
+{
+  struct kswapd_proc **link, *kp;
+
+  pthread_mutex_lock(&kswapd_lock);
+  for (link = &kswapd_procs; *link != NULL; link = &(*link)->next)
+    if ((*link)->proc == proc)
+    {
+      kp = *link;
+      *link = kp->next;
+      if (kswapd_next == kp)
+        kswapd_next = kp->next;
+      free(kp);
+      break;
+    }
+  pthread_mutex_unlock(&kswapd_lock);
+}
+
+/*
+ *  kswapd_balance - evict until @mram has the high watermark free
+ *  kswapd_lock held. Return the number of frames freed.
+ */
+static int kswapd_balance(struct memphy_struct *mram)
+{
+  int low = mram->maxfp * MM_KSWAPD_LOW / 100;
+  int high = mram->maxfp * MM_KSWAPD_HIGH / 100;
+  struct kswapd_proc *kp;
+  int freed = 0, idle = 0, fpn;
+
+  /* Even a tiny MEMRAM keeps one frame ready for the next fault */
+  if (low < 1)
+    low = 1;
+  if (high < low)
+    high = low;
+
+  if (mram->free_fp_cnt >= low || kswapd_procs == NULL)
+    return 0;
+
+  kswapd_wakeups++;
+  while (mram->free_fp_cnt < high && idle < 2)
+  {
+    /* One full round without a victim, nothing is reclaimable now */
+    if (kswapd_next == NULL)
+    {
+      kswapd_next = kswapd_procs;
+      idle++;
+    }
+    kp = kswapd_next;
+    kswapd_next = kp->next;
+
+    if (pthread_mutex_trylock(&kp->proc->mm->mm_lock) != 0)
+      continue;
+
+    if (pg_evict_page(kp->proc->mm, &fpn, kp->proc) == 0)
+    {
+      MEMPHY_put_freefp(mram, fpn);
+      freed++;
+      idle = 0;
+    }
+    pthread_mutex_unlock(&kp->proc->mm->mm_lock);
+  }
+
+  kswapd_reclaimed += freed;
+  return freed;
+}
+
+/*
+ *  kswapd_routine - reclaim thread, one balance pass per time slot
+ *  @args: struct kswapd_args
+ */
+void *kswapd_routine(void *args)
+{
+  struct timer_id_t *timer_id = ((struct kswapd_args *)args)->timer_id;
+  struct memphy_struct *mram = ((struct kswapd_args *)args)->mram;
+
+  while (!kswapd_stopped)
+  {
+    pthread_mutex_lock(&kswapd_lock);
+    kswapd_balance(mram);
+    pthread_mutex_unlock(&kswapd_lock);
+
+    next_slot(timer_id);
+  }
+
+  detach_event(timer_id);
+  pthread_exit(NULL);
+}
+
+/*
+ *  kswapd_stop - let the thread leave after its current slot
+ */
+void kswapd_stop(void)
+{
+  kswapd_stopped = 1;
+}
+
+/*
+ *  print_kswapd_stats - report the background reclaim
+ */
+void print_kswapd_stats(void)
+{
+  printf("kswapd: %lu wakeups, %lu frames reclaimed\n",
+         kswapd_wakeups, kswapd_reclaimed);
+}
+#endif
+
+// #endif
@@ -5,33 +5,92 @@
  */
 
 #include "mm.h"
+#include "checkpoint.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "timer.h"
+#ifdef MM_MMAP_STORAGE
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* Only a sequential device has shared state to guard on data access */
+static void __memphy_lock(struct memphy_struct *mp)
+{
+  if (!mp->rdmflg)
+    pthread_mutex_lock(&mp->lock);
+}
+
+static void __memphy_unlock(struct memphy_struct *mp)
+{
+  if (!mp->rdmflg)
+    pthread_mutex_unlock(&mp->lock);
+}
+
+/* Frame @fpn changed since the last dump, see MEMPHY_dump */
+static void __memphy_dirty(struct memphy_struct *mp, int fpn)
+{
+  if (!(mp->dirty_fp_map[MEMPHY_MAP_WORD(fpn)] & MEMPHY_MAP_MASK(fpn)))
+    __sync_fetch_and_or(&mp->dirty_fp_map[MEMPHY_MAP_WORD(fpn)], MEMPHY_MAP_MASK(fpn));
+}
 
-pthread_mutex_t lock_mem;
+#ifdef MM_SEEK_COST
+/* Distance the calling CPU moved sequential cursors, not charged yet */
+static __thread unsigned long memphy_seek_debt;
+#endif
 
-FILE *file;
+/* A cursor passes over @dist bytes */
+static void __memphy_travel(struct memphy_struct *mp, unsigned long dist)
+{
+  __sync_fetch_and_add(&mp->seek_bytes, dist);
+#ifdef MM_SEEK_COST
+  memphy_seek_debt += dist;
+#endif
+}
 
 /*
  *  MEMPHY_mv_csr - move MEMPHY cursor
  *  @mp: memphy struct
  *  @offset: offset
+ *
+ *  The cursor lands at once, the distance from where it was is what a
+ *  real head pays for, see MEMPHY_seek_stall.
  */
 int MEMPHY_mv_csr(struct memphy_struct *mp, int offset)
 {
-  int numstep = 0;
+  int target = (offset > 0 && offset < mp->maxsz) ? offset : 0;
 
-  mp->cursor = 0;
-  while (numstep < offset && numstep < mp->maxsz)
-  {
-    /* Traverse sequentially */
-    mp->cursor = (mp->cursor + 1) % mp->maxsz;
-    numstep++;
-  }
+  __memphy_travel(mp, abs(target - mp->cursor));
+  mp->cursor = target;
 
   return 0;
 }
 
+/* Seek a sequential device to the frame at @addr, then stream past it */
+static void __memphy_stream(struct memphy_struct *mp, int addr)
+{
+  MEMPHY_mv_csr(mp, addr);
+  __memphy_travel(mp, PAGING_PAGESZ);
+  mp->cursor = (addr + PAGING_PAGESZ) % mp->maxsz;
+}
+
+#ifdef MM_SEEK_COST
+/*
+ *  MEMPHY_seek_stall - time slots the calling CPU owes for seeking
+ *  Whole slots of MM_SEEK_COST bytes are charged, the rest carries over.
+ */
+int MEMPHY_seek_stall(void)
+{
+  int stall = memphy_seek_debt / MM_SEEK_COST;
+
+  memphy_seek_debt %= MM_SEEK_COST;
+  return stall;
+}
+#endif
+
 /*
  *  MEMPHY_seq_read - read MEMPHY device
  *  @mp: memphy struct
@@ -43,11 +102,13 @@ int MEMPHY_seq_read(struct memphy_struct *mp, int addr, BYTE *value)
   if (mp == NULL)
     return -1;
 
-  if (!mp->rdmflg)
+  if (mp->rdmflg)
     return -1; /* Not compatible mode for sequential read */
 
+  __memphy_lock(mp);
   MEMPHY_mv_csr(mp, addr);
   *value = (BYTE)mp->storage[addr];
+  __memphy_unlock(mp);
 
   return 0;
 }
@@ -83,12 +144,15 @@ int MEMPHY_seq_write(struct memphy_struct *mp, int addr, BYTE value)
   if (mp == NULL)
     return -1;
 
-  if (!mp->rdmflg)
-    return -1; /* Not compatible mode for sequential read */
+  if (mp->rdmflg)
+    return -1; /* Not compatible mode for sequential write */
 
+  __memphy_lock(mp);
   MEMPHY_mv_csr(mp, addr);
   // mp->storage[addr] = (uint8_t)value;
   mp->storage[addr] = value;
+  __memphy_dirty(mp, addr / PAGING_PAGESZ);
+  __memphy_unlock(mp);
 
   return 0;
 }
@@ -101,23 +165,127 @@ int MEMPHY_seq_write(struct memphy_struct *mp, int addr, BYTE value)
  */
 int MEMPHY_write(struct memphy_struct *mp, int addr, BYTE data)
 {
-  pthread_mutex_lock(&lock_mem);
   if (mp == NULL)
-  {
-    pthread_mutex_unlock(&lock_mem);
     return -1;
-  }
 
   if (mp->rdmflg)
   {
     mp->storage[addr] = data;
-    pthread_mutex_unlock(&lock_mem);
+    __memphy_dirty(mp, addr / PAGING_PAGESZ);
   }
   else /* Sequential access device */
-  {
-    pthread_mutex_unlock(&lock_mem);
     return MEMPHY_seq_write(mp, addr, data);
-  }
+
+  return 0;
+}
+
+/*
+ *  MEMPHY_cp_frame - copy one whole frame between MEMPHY devices
+ *  @mpsrc: source memphy
+ *  @srcfpn: source frame number
+ *  @mpdst: destination memphy
+ *  @dstfpn: destination frame number
+ *
+ *  The page moves as one block. A sequential device first seeks its
+ *  cursor to the frame, then streams through it, holding its lock. Two
+ *  of them are locked in address order.
+ */
+int MEMPHY_cp_frame(struct memphy_struct *mpsrc, int srcfpn,
+                    struct memphy_struct *mpdst, int dstfpn)
+{
+  int addrsrc = srcfpn * PAGING_PAGESZ;
+  int addrdst = dstfpn * PAGING_PAGESZ;
+
+  if (mpsrc == NULL || mpdst == NULL)
+    return -1;
+
+  if (addrsrc < 0 || addrsrc + PAGING_PAGESZ > mpsrc->maxsz ||
+      addrdst < 0 || addrdst + PAGING_PAGESZ > mpdst->maxsz)
+    return -1;
+
+  if (mpsrc < mpdst)
+    __memphy_lock(mpsrc);
+  __memphy_lock(mpdst);
+  if (mpsrc > mpdst)
+    __memphy_lock(mpsrc);
+
+  /* Sequential devices end up right past the frame they streamed */
+  if (!mpsrc->rdmflg)
+    __memphy_stream(mpsrc, addrsrc);
+  if (!mpdst->rdmflg)
+    __memphy_stream(mpdst, addrdst);
+
+  memcpy(mpdst->storage + addrdst, mpsrc->storage + addrsrc, PAGING_PAGESZ);
+  __memphy_dirty(mpdst, dstfpn);
+
+  if (mpsrc != mpdst)
+    __memphy_unlock(mpsrc);
+  __memphy_unlock(mpdst);
+
+  return 0;
+}
+
+/*
+ *  MEMPHY_zero_frame - fill one frame with zeros
+ *  @mp: memphy struct
+ *  @fpn: frame number
+ */
+int MEMPHY_zero_frame(struct memphy_struct *mp, int fpn)
+{
+  int addr = fpn * PAGING_PAGESZ;
+
+  if (mp == NULL || addr < 0 || addr + PAGING_PAGESZ > mp->maxsz)
+    return -1;
+
+  __memphy_lock(mp);
+  memset(mp->storage + addr, 0, PAGING_PAGESZ);
+  __memphy_dirty(mp, fpn);
+  __memphy_unlock(mp);
+
+  return 0;
+}
+
+/*
+ *  MEMPHY_get_frame - copy one frame out to a host buffer
+ *  @mp: memphy struct
+ *  @fpn: frame number
+ *  @buf: PAGING_PAGESZ bytes
+ */
+int MEMPHY_get_frame(struct memphy_struct *mp, int fpn, BYTE *buf)
+{
+  int addr = fpn * PAGING_PAGESZ;
+
+  if (mp == NULL || addr < 0 || addr + PAGING_PAGESZ > mp->maxsz)
+    return -1;
+
+  __memphy_lock(mp);
+  if (!mp->rdmflg)
+    __memphy_stream(mp, addr);
+  memcpy(buf, mp->storage + addr, PAGING_PAGESZ);
+  __memphy_unlock(mp);
+
+  return 0;
+}
+
+/*
+ *  MEMPHY_set_frame - fill one frame from a host buffer
+ *  @mp: memphy struct
+ *  @fpn: frame number
+ *  @buf: PAGING_PAGESZ bytes
+ */
+int MEMPHY_set_frame(struct memphy_struct *mp, int fpn, BYTE *buf)
+{
+  int addr = fpn * PAGING_PAGESZ;
+
+  if (mp == NULL || addr < 0 || addr + PAGING_PAGESZ > mp->maxsz)
+    return -1;
+
+  __memphy_lock(mp);
+  if (!mp->rdmflg)
+    __memphy_stream(mp, addr);
+  memcpy(mp->storage + addr, buf, PAGING_PAGESZ);
+  __memphy_dirty(mp, fpn);
+  __memphy_unlock(mp);
 
   return 0;
 }
@@ -125,161 +293,1295 @@ int MEMPHY_write(struct memphy_struct *mp, int addr, BYTE data)
 /*
  *  MEMPHY_format-format MEMPHY device
  *  @mp: memphy struct
+ *
+ *  The frame maps come from calloc so the host only backs the words
+ *  the allocator actually touches, formatting a huge swap is O(1).
+ *  All frames start in a single node.
  */
 int MEMPHY_format(struct memphy_struct *mp, int pagesz)
 {
   /* This setting come with fixed constant PAGESZ */
   int numfp = mp->maxsz / pagesz;
-  struct framephy_struct *newfst, *fst;
-  int iter = 0;
+  int nwords, nsummary, tail;
+
+  mp->maxfp = mp->free_fp_cnt = 0;
+  mp->fp_map = mp->fp_summary = mp->used_fp_map = mp->dirty_fp_map = NULL;
+  mp->fp_refcnt = mp->fp_remote = NULL;
+
+  mp->mags = NULL;
+  mp->cached_fp_map = NULL;
+  mp->nmags = mp->mag_batch = 0;
+
+  mp->nnodes = 1;
+  mp->nodes = calloc(1, sizeof(struct memphy_node));
+  pthread_mutex_init(&mp->nodes[0].lock, NULL);
 
   if (numfp <= 0)
     return -1;
 
-  /* Init head of free framephy list */
-  fst = malloc(sizeof(struct framephy_struct));
-  fst->fpn = iter;
-  mp->free_fp_list = fst;
+  nwords = MEMPHY_MAP_NWORDS(numfp);
+  nsummary = MEMPHY_MAP_NWORDS(nwords);
+
+  mp->maxfp = numfp;
+  mp->free_fp_cnt = numfp;
+  mp->fp_map = calloc(nwords, sizeof(uint64_t));
+  mp->used_fp_map = calloc(nwords, sizeof(uint64_t));
+  mp->dirty_fp_map = calloc(nwords, sizeof(uint64_t));
+  mp->fp_summary = calloc(nsummary, sizeof(uint64_t));
+  mp->fp_refcnt = calloc(numfp, sizeof(int));
+  mp->fp_remote = calloc(numfp, sizeof(int));
+
+  mp->nodes[0].end_fp = numfp;
+  mp->nodes[0].free_fp_cnt = numfp;
+
+  /* Bits past the last frame are never handed out, mark them taken */
+  tail = numfp % MEMPHY_MAP_WORDSZ;
+  if (tail != 0)
+    mp->fp_map[nwords - 1] = ~0ULL << tail;
+
+  tail = nwords % MEMPHY_MAP_WORDSZ;
+  if (tail != 0)
+    mp->fp_summary[nsummary - 1] = ~0ULL << tail;
 
-  /* We have list with first element, fill in the rest num-1 element member*/
-  for (iter = 1; iter < numfp; iter++)
+  return 0;
+}
+
+/*
+ *  __memphy_node - node holding frame @fpn
+ */
+static struct memphy_node *__memphy_node(struct memphy_struct *mp, int fpn)
+{
+  int nid = mp->nnodes - 1;
+
+  while (nid > 0 && fpn < mp->nodes[nid].start_fp)
+    nid--;
+
+  return &mp->nodes[nid];
+}
+
+/*
+ *  __memphy_summary - keep the summary bit of map word @wit up to date
+ *  Summary words span several nodes, their bits change atomically.
+ */
+static void __memphy_summary(struct memphy_struct *mp, int wit)
+{
+  uint64_t *summary = &mp->fp_summary[MEMPHY_MAP_WORD(wit)];
+
+  if (mp->fp_map[wit] == ~0ULL)
+    __sync_fetch_and_or(summary, MEMPHY_MAP_MASK(wit));
+  else
+    __sync_fetch_and_and(summary, ~MEMPHY_MAP_MASK(wit));
+}
+
+/*
+ *  __memphy_ffz - find first zero bit in the frame map of a node
+ *  @mp: memphy struct
+ *  @nd: node, its lock held
+ *
+ *  Every fp_map word of the node below fp_hint is full, so the first
+ *  clear summary bit from the hint onward names the first word with a
+ *  free frame. Bits below the hint may belong to a lower node and are
+ *  ignored, a word past the node means it is full.
+ */
+static int __memphy_ffz(struct memphy_struct *mp, struct memphy_node *nd)
+{
+  int endword = MEMPHY_MAP_NWORDS(nd->end_fp);
+  int nsummary = MEMPHY_MAP_NWORDS(endword);
+  uint64_t summary;
+  int sit, wit;
+
+  for (sit = MEMPHY_MAP_WORD(nd->fp_hint); sit < nsummary; sit++)
   {
-    newfst = malloc(sizeof(struct framephy_struct));
-    newfst->fpn = iter;
-    newfst->fp_next = NULL;
-    fst->fp_next = newfst;
-    fst = newfst;
+    summary = mp->fp_summary[sit];
+    if (sit == MEMPHY_MAP_WORD(nd->fp_hint))
+      summary |= MEMPHY_MAP_MASK(nd->fp_hint) - 1;
+    if (summary == ~0ULL)
+      continue;
+
+    wit = sit * MEMPHY_MAP_WORDSZ + __builtin_ctzll(~summary);
+    if (wit >= endword)
+      return -1;
+    nd->fp_hint = wit;
+
+    return wit * MEMPHY_MAP_WORDSZ + __builtin_ctzll(~mp->fp_map[wit]);
   }
 
-  return 0;
+  return -1;
 }
 
-/*  return frame number of first free frame in free frame list to retfpn
- *   return 0 if success, -1 if there no free frame in RAM
+static __thread int memphy_cpu = -1;
+
+/*
+ *  MEMPHY_bind_cpu - make the calling CPU thread allocate near @cpuid
  */
-int MEMPHY_get_freefp(struct memphy_struct *mp, int *retfpn)
+void MEMPHY_bind_cpu(int cpuid)
+{
+  memphy_cpu = cpuid;
+}
+
+/*
+ *  MEMPHY_home_node - node of @mp the calling CPU allocates from first
+ *  Threads that are no CPU use the first node.
+ */
+int MEMPHY_home_node(struct memphy_struct *mp)
+{
+  return (memphy_cpu < 0) ? 0 : memphy_cpu % mp->nnodes;
+}
+
+/*
+ *  MEMPHY_node_of - node of @mp holding frame @fpn
+ */
+int MEMPHY_node_of(struct memphy_struct *mp, int fpn)
+{
+  return __memphy_node(mp, fpn) - mp->nodes;
+}
+
+/*
+ *  __memphy_get_batch - take upto @n free frames of node @nid
+ *  @fpns: return the frames
+ *  @used: mark them holding live data right away
+ *  return the number of frames taken, all under one lock hold
+ *
+ *  The device free count is left to the caller, frames cached by a
+ *  magazine still count as free.
+ */
+static int __memphy_get_batch(struct memphy_struct *mp, int nid, int n, int *fpns, int used)
+{
+  struct memphy_node *nd = &mp->nodes[nid];
+  int got, fpn;
+
+  pthread_mutex_lock(&nd->lock);
+  for (got = 0; got < n && nd->free_fp_cnt > 0; got++)
+  {
+    if ((fpn = __memphy_ffz(mp, nd)) < 0)
+      break;
+
+    fpns[got] = fpn;
+    mp->fp_map[MEMPHY_MAP_WORD(fpn)] |= MEMPHY_MAP_MASK(fpn);
+    __memphy_summary(mp, MEMPHY_MAP_WORD(fpn));
+    nd->free_fp_cnt--;
+
+    if (used)
+    {
+      __sync_fetch_and_or(&mp->used_fp_map[MEMPHY_MAP_WORD(fpn)], MEMPHY_MAP_MASK(fpn));
+      __memphy_dirty(mp, fpn);
+    }
+  }
+
+  if (nid == MEMPHY_home_node(mp))
+    nd->alloc_local += got;
+  else
+    nd->alloc_remote += got;
+  pthread_mutex_unlock(&nd->lock);
+
+  return got;
+}
+
+/*
+ *  __memphy_put_batch - give the frames of node @nd among @fpns back
+ *  return the number of frames freed, all under one lock hold
+ *
+ *  Frames of other nodes and frames already free, in a magazine too, are
+ *  skipped.
+ */
+static int __memphy_put_batch(struct memphy_struct *mp, struct memphy_node *nd,
+                              int n, int *fpns)
+{
+  int fpit, fpn, freed = 0;
+
+  pthread_mutex_lock(&nd->lock);
+  for (fpit = 0; fpit < n; fpit++)
+  {
+    fpn = fpns[fpit];
+    if (fpn < nd->start_fp || fpn >= nd->end_fp)
+      continue;
+    if (mp->cached_fp_map != NULL &&
+        (mp->cached_fp_map[MEMPHY_MAP_WORD(fpn)] & MEMPHY_MAP_MASK(fpn)))
+      continue;
+
+    __sync_fetch_and_and(&mp->used_fp_map[MEMPHY_MAP_WORD(fpn)], ~MEMPHY_MAP_MASK(fpn));
+    __memphy_dirty(mp, fpn);
+    mp->fp_refcnt[fpn] = 0;
+    mp->fp_remote[fpn] = 0;
+
+    if (!(mp->fp_map[MEMPHY_MAP_WORD(fpn)] & MEMPHY_MAP_MASK(fpn)))
+      continue;
+
+    mp->fp_map[MEMPHY_MAP_WORD(fpn)] &= ~MEMPHY_MAP_MASK(fpn);
+    __memphy_summary(mp, MEMPHY_MAP_WORD(fpn));
+    nd->free_fp_cnt++;
+    freed++;
+
+    if (MEMPHY_MAP_WORD(fpn) < nd->fp_hint)
+      nd->fp_hint = MEMPHY_MAP_WORD(fpn);
+  }
+  pthread_mutex_unlock(&nd->lock);
+
+  return freed;
+}
+
+#ifdef MM_MAGAZINE
+/*
+ *  Per CPU magazine of free frames of the home node of the CPU, refilled
+ *  from and flushed to the node mag_batch frames at a time. Its lock is
+ *  only contended by another CPU out of frames draining it.
+ */
+struct memphy_magazine {
+  int nfp;
+  int fpn[2 * MM_MAGAZINE];
+  unsigned long hit;
+  unsigned long refill;
+  unsigned long flush;
+  pthread_mutex_t lock;
+};
+
+static struct memphy_magazine *__memphy_mag(struct memphy_struct *mp)
+{
+  if (mp->mags == NULL || memphy_cpu < 0 || memphy_cpu >= mp->nmags)
+    return NULL;
+
+  return &mp->mags[memphy_cpu];
+}
+
+/* Set or clear the cached bit of @n frames entering or leaving a magazine */
+static void __memphy_mag_mark(struct memphy_struct *mp, int n, int *fpns, int cached)
+{
+  int fpit, fpn;
+
+  for (fpit = 0; fpit < n; fpit++)
+  {
+    fpn = fpns[fpit];
+    if (cached)
+      __sync_fetch_and_or(&mp->cached_fp_map[MEMPHY_MAP_WORD(fpn)], MEMPHY_MAP_MASK(fpn));
+    else
+      __sync_fetch_and_and(&mp->cached_fp_map[MEMPHY_MAP_WORD(fpn)], ~MEMPHY_MAP_MASK(fpn));
+  }
+}
+
+/* Take a frame from the magazine of the calling CPU, refill it if empty */
+static int __memphy_mag_get(struct memphy_struct *mp, int *retfpn)
 {
-  pthread_mutex_lock(&lock_mem);
-  struct framephy_struct *fp = mp->free_fp_list;
+  struct memphy_magazine *mag = __memphy_mag(mp);
+
+  if (mag == NULL)
+    return -1;
+
+  pthread_mutex_lock(&mag->lock);
+  if (mag->nfp > 0)
+    mag->hit++;
+  else
+  {
+    mag->nfp = __memphy_get_batch(mp, MEMPHY_home_node(mp), mp->mag_batch, mag->fpn, 0);
+    __memphy_mag_mark(mp, mag->nfp, mag->fpn, 1);
+    mag->refill++;
+  }
 
-  if (fp == NULL)
+  if (mag->nfp == 0)
   {
-    pthread_mutex_unlock(&lock_mem);
+    pthread_mutex_unlock(&mag->lock);
     return -1;
   }
 
-  *retfpn = fp->fpn;
-  mp->free_fp_list = fp->fp_next;
+  *retfpn = mag->fpn[--mag->nfp];
+  __memphy_mag_mark(mp, 1, retfpn, 0);
+  pthread_mutex_unlock(&mag->lock);
 
-  /* MEMPHY is iteratively used up until its exhausted
-   * No garbage collector acting then it not been released
-   */
-  free(fp);
-  pthread_mutex_unlock(&lock_mem);
+  __sync_fetch_and_sub(&mp->free_fp_cnt, 1);
   return 0;
 }
 
-int MEMPHY_dump(struct memphy_struct *mp)
+/* Cache a freed frame of the home node, a full magazine flushes its oldest.
+ * The caller set the cached bit of @fpn. */
+static int __memphy_mag_put(struct memphy_struct *mp, int fpn)
 {
-  /*TODO dump memphy contnt mp->storage
-   *     for tracing the memory content
-   */
-  pthread_mutex_lock(&lock_mem);
-  /*
-    if (mp->rdmflg == 1) {
-      for (int i = 0; i<mp->maxsz; ++i) {
-        if (i%256 == 0) printf("\n\t\tFrame %d", PAGING_PAGE_ALIGNSZ(i)/PAGING_PAGESZ);
-        if (i%32 == 0) printf("\n");
-        printf("%d ", (int)(mp->storage[i]));
-        if (i == mp->maxsz - 1) printf("\n");
-      }
-    } else {
-      // do nothing
-    }
-   */
-  file = fopen("RAM_status.txt", "w");
-  struct framephy_struct *frameit = mp->used_fp_list;
-  while (frameit != NULL) {
-#ifdef DUMP_TO_FILE
-    fprintf(file, "\t\t Frame %08x", frameit->fpn);
-#else
-    printf("\t\t Frame %d", frameit->fpn);
-#endif
-    for (int off = 0; off < PAGING_PAGESZ; ++off) {
-      if (off % 32 == 0)  {
-#ifdef DUMP_TO_FILE
-        fprintf(file, "\n");
-#else
-        printf("\n");
-#endif
-      }
-#ifdef DUMP_TO_FILE
-      fprintf(file, "%d ", mp->storage[frameit->fpn * PAGING_PAGESZ + off]);
-#else
-      printf("%d ", mp->storage[frameit->fpn * PAGING_PAGESZ + off]);
-#endif
-    }
-#ifdef DUMP_TO_FILE
-    fprintf(file, "\n");
-#else
-    printf("\n");
-#endif
-    frameit = frameit->fp_next;
+  struct memphy_magazine *mag = __memphy_mag(mp);
+  struct memphy_node *nd = __memphy_node(mp, fpn);
+
+  if (mag == NULL || nd != &mp->nodes[MEMPHY_home_node(mp)])
+    return -1;
+
+  pthread_mutex_lock(&mag->lock);
+  if (mag->nfp == 2 * mp->mag_batch)
+  {
+    __memphy_mag_mark(mp, mp->mag_batch, mag->fpn, 0);
+    __memphy_put_batch(mp, nd, mp->mag_batch, mag->fpn);
+    mag->nfp -= mp->mag_batch;
+    memmove(mag->fpn, mag->fpn + mp->mag_batch, mag->nfp * sizeof(int));
+    mag->flush++;
   }
+  mag->fpn[mag->nfp++] = fpn;
+  pthread_mutex_unlock(&mag->lock);
 
-  fclose(file);
-  pthread_mutex_unlock(&lock_mem);
+  __sync_fetch_and_add(&mp->free_fp_cnt, 1);
   return 0;
 }
 
-int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn)
+/* Out of frames everywhere else, take one cached by another CPU */
+static int __memphy_mag_steal(struct memphy_struct *mp, int *retfpn)
+{
+  struct memphy_magazine *mag;
+  int cit;
+
+  for (cit = 0; mp->mags != NULL && cit < mp->nmags; cit++)
+  {
+    mag = &mp->mags[cit];
+
+    pthread_mutex_lock(&mag->lock);
+    if (mag->nfp > 0)
+    {
+      *retfpn = mag->fpn[--mag->nfp];
+      __memphy_mag_mark(mp, 1, retfpn, 0);
+      pthread_mutex_unlock(&mag->lock);
+
+      __sync_fetch_and_sub(&mp->free_fp_cnt, 1);
+      return 0;
+    }
+    pthread_mutex_unlock(&mag->lock);
+  }
+
+  return -1;
+}
+
+/* Give every cached frame back to its node, the magazines end up empty */
+static void __memphy_mag_drain(struct memphy_struct *mp)
+{
+  struct memphy_magazine *mag;
+  int cit, nid;
+
+  for (cit = 0; mp->mags != NULL && cit < mp->nmags; cit++)
+  {
+    mag = &mp->mags[cit];
+
+    pthread_mutex_lock(&mag->lock);
+    __memphy_mag_mark(mp, mag->nfp, mag->fpn, 0);
+    for (nid = 0; nid < mp->nnodes; nid++)
+      __memphy_put_batch(mp, &mp->nodes[nid], mag->nfp, mag->fpn);
+    mag->nfp = 0;
+    pthread_mutex_unlock(&mag->lock);
+  }
+}
+
+/* Some aligned 2^order block is free but for frames cached in magazines.
+ * The maps are only peeked at, the allocation after a drain decides */
+static int __memphy_mag_holds_block(struct memphy_struct *mp, int order)
 {
-  struct framephy_struct *fp = mp->free_fp_list;
-  struct framephy_struct *newnode = malloc(sizeof(struct framephy_struct));
+  struct memphy_node *nd;
+  int blksz = 1 << order;
+  int nid, fpn, fpit;
 
-  /* Create new node with value fpn */
-  newnode->fpn = fpn;
-  newnode->fp_next = fp;
-  mp->free_fp_list = newnode;
+  if (mp->free_fp_cnt < blksz)
+    return 0;
+
+  for (nid = 0; nid < mp->nnodes; nid++)
+  {
+    nd = &mp->nodes[nid];
+    fpn = nd->start_fp + (blksz - nd->start_fp % blksz) % blksz;
+    for (; fpn + blksz <= nd->end_fp; fpn += blksz)
+    {
+      for (fpit = fpn; fpit < fpn + blksz; fpit++)
+        if (mp->fp_map[MEMPHY_MAP_WORD(fpit)] &
+            ~mp->cached_fp_map[MEMPHY_MAP_WORD(fpit)] & MEMPHY_MAP_MASK(fpit))
+          break;
+
+      if (fpit == fpn + blksz)
+        return 1;
+    }
+  }
 
   return 0;
 }
 
-int MEMPHY_put_usedfp(struct memphy_struct *mp, int fpn)
+/*
+ *  MEMPHY_init_magazines - give each of @ncpu CPUs a frame magazine
+ *  The batch shrinks with the node, a tiny one is not worth caching.
+ *  Return 0 with magazines, 1 if the device goes without, -1 on failure.
+ */
+int MEMPHY_init_magazines(struct memphy_struct *mp, int ncpu)
 {
+  int cit, batch = MM_MAGAZINE;
 
-  pthread_mutex_lock(&lock_mem);
-  // struct framephy_struct *fp = (*mp)->used_fp_list;
+  if (ncpu <= 0)
+    return -1;
+
+  for (cit = 0; cit < mp->nnodes; cit++)
+    if ((mp->nodes[cit].end_fp - mp->nodes[cit].start_fp) / (4 * ncpu) < batch)
+      batch = (mp->nodes[cit].end_fp - mp->nodes[cit].start_fp) / (4 * ncpu);
 
-  struct framephy_struct *newnode = malloc(sizeof(struct framephy_struct));
+  if (batch < 1)
+    return 1;
 
-  /* Create new node with value fpn */
-  newnode->fpn = fpn;
-  // newnode->fp_next = fp;
-  newnode->fp_next = mp->used_fp_list;
-  mp->used_fp_list = newnode;
+  mp->cached_fp_map = calloc(MEMPHY_MAP_NWORDS(mp->maxfp), sizeof(uint64_t));
+  mp->mags = calloc(ncpu, sizeof(struct memphy_magazine));
+  if (mp->cached_fp_map == NULL || mp->mags == NULL)
+  {
+    free(mp->cached_fp_map);
+    free(mp->mags);
+    mp->cached_fp_map = NULL;
+    mp->mags = NULL;
+    return -1;
+  }
 
-  pthread_mutex_unlock(&lock_mem);
+  mp->mag_batch = batch;
+  for (cit = 0; cit < ncpu; cit++)
+    pthread_mutex_init(&mp->mags[cit].lock, NULL);
+  mp->nmags = ncpu;
 
   return 0;
 }
 
 /*
- *  Init MEMPHY struct
+ *  MEMPHY_print_magazines - report how often the CPUs hit their magazine
  */
-int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
+void MEMPHY_print_magazines(struct memphy_struct *mp)
 {
-  mp->storage = (BYTE *)malloc(max_size * sizeof(BYTE));
-  mp->maxsz = max_size;
+  unsigned long hit = 0, refill = 0, flush = 0;
+  int cit;
 
-  mp->used_fp_list = NULL;
+  if (mp->mags == NULL)
+    return;
 
-  MEMPHY_format(mp, PAGING_PAGESZ);
+  for (cit = 0; cit < mp->nmags; cit++)
+  {
+    hit += mp->mags[cit].hit;
+    refill += mp->mags[cit].refill;
+    flush += mp->mags[cit].flush;
+  }
 
-  mp->rdmflg = (randomflg != 0) ? 1 : 0;
+  printf("Frame magazines: batch %d, %lu hits, %lu refills, %lu flushes\n",
+         mp->mag_batch, hit, refill, flush);
+}
+#endif
+
+/*
+ *  MEMPHY_get_freefp_node - take the first free frame of one node
+ *  @mp: memphy struct
+ *  @nid: node
+ *  @retfpn: frame number
+ *  return 0 if success, -1 if the node has no free frame
+ */
+int MEMPHY_get_freefp_node(struct memphy_struct *mp, int nid, int *retfpn)
+{
+  if (__memphy_get_batch(mp, nid, 1, retfpn, 0) != 1)
+    return -1;
+
+  __sync_fetch_and_sub(&mp->free_fp_cnt, 1);
+  return 0;
+}
+
+/*  return frame number of first free frame in free frame list to retfpn
+ *   return 0 if success, -1 if there no free frame in RAM
+ *   The magazine of the calling CPU goes first, then its home node and
+ *   the next ones.
+ */
+int MEMPHY_get_freefp(struct memphy_struct *mp, int *retfpn)
+{
+  int home = MEMPHY_home_node(mp);
+  int nit;
 
-  if (!mp->rdmflg) /* Not Ramdom acess device, then it serial device*/
-    mp->cursor = 0;
+#ifdef MM_MAGAZINE
+  if (__memphy_mag_get(mp, retfpn) == 0)
+    return 0;
+#endif
+
+  for (nit = 0; nit < mp->nnodes; nit++)
+    if (MEMPHY_get_freefp_node(mp, (home + nit) % mp->nnodes, retfpn) == 0)
+      return 0;
+
+#ifdef MM_MAGAZINE
+  return __memphy_mag_steal(mp, retfpn);
+#else
+  return -1;
+#endif
+}
+
+/*
+ *  MEMPHY_get_freefp_bulk - take upto @n free frames at once
+ *  @mp: memphy struct
+ *  @n: number of frames wanted
+ *  @fpns: return the frames, room for @n
+ *  return the number of frames taken
+ *
+ *  One lock hold per node visited, the home node of the calling CPU
+ *  first. The frames come back already marked used.
+ */
+int MEMPHY_get_freefp_bulk(struct memphy_struct *mp, int n, int *fpns)
+{
+  int home = MEMPHY_home_node(mp);
+  int nit, got = 0;
+
+  for (nit = 0; nit < mp->nnodes && got < n; nit++)
+    got += __memphy_get_batch(mp, (home + nit) % mp->nnodes, n - got, fpns + got, 1);
+
+  __sync_fetch_and_sub(&mp->free_fp_cnt, got);
+  return got;
+}
+
+/*
+ *  MEMPHY_put_freefp_bulk - release @n frames at once
+ *  @mp: memphy struct
+ *  @n: number of frames
+ *  @fpns: the frames
+ *
+ *  One lock hold per node, the frames bypass the magazines.
+ */
+int MEMPHY_put_freefp_bulk(struct memphy_struct *mp, int n, int *fpns)
+{
+  int nid, freed = 0;
+
+  for (nid = 0; nid < mp->nnodes; nid++)
+    freed += __memphy_put_batch(mp, &mp->nodes[nid], n, fpns);
+
+  __sync_fetch_and_add(&mp->free_fp_cnt, freed);
+  return 0;
+}
+
+/*
+ *  __memphy_mark_block - set or clear a 2^order block in the frame map
+ *  @mp: memphy struct
+ *  @nd: node of the block, its lock held
+ *  @fpn: first frame of the block
+ *  @order: block order
+ *  @taken: 1 to allocate, 0 to release
+ */
+static void __memphy_mark_block(struct memphy_struct *mp, struct memphy_node *nd,
+                                int fpn, int order, int taken)
+{
+  int fpit, wit;
+
+  for (fpit = fpn; fpit < fpn + (1 << order); fpit++)
+  {
+    wit = MEMPHY_MAP_WORD(fpit);
+    if (taken)
+      mp->fp_map[wit] |= MEMPHY_MAP_MASK(fpit);
+    else
+      mp->fp_map[wit] &= ~MEMPHY_MAP_MASK(fpit);
+
+    __memphy_summary(mp, wit);
+  }
+
+  if (taken)
+  {
+    nd->free_fp_cnt -= 1 << order;
+    __sync_fetch_and_sub(&mp->free_fp_cnt, 1 << order);
+  }
+  else
+  {
+    nd->free_fp_cnt += 1 << order;
+    __sync_fetch_and_add(&mp->free_fp_cnt, 1 << order);
+    if (MEMPHY_MAP_WORD(fpn) < nd->fp_hint)
+      nd->fp_hint = MEMPHY_MAP_WORD(fpn);
+  }
+}
+
+/*
+ *  __memphy_get_block - find a free 2^order block inside one node
+ *  @nd: node, its lock held
+ *  return the first frame of the block, -1 if there is none
+ */
+static int __memphy_get_block(struct memphy_struct *mp, struct memphy_node *nd, int order)
+{
+  int startword = MEMPHY_MAP_WORD(nd->start_fp);
+  int endword = MEMPHY_MAP_NWORDS(nd->end_fp);
+  int wit, bit, kit;
+  int blksz = 1 << order;
+
+  if (nd->free_fp_cnt < blksz)
+    return -1;
+
+  if (blksz >= MEMPHY_MAP_WORDSZ)
+  { /* Block spans whole map words, look for a run of empty words */
+    int blkwords = blksz / MEMPHY_MAP_WORDSZ;
+
+    wit = nd->fp_hint - nd->fp_hint % blkwords;
+    if (wit < startword)
+      wit += blkwords;
+
+    for (; wit + blkwords <= endword; wit += blkwords)
+    {
+      for (kit = 0; kit < blkwords; kit++)
+        if (mp->fp_map[wit + kit] != 0)
+          break;
+
+      if (kit == blkwords)
+        return wit * MEMPHY_MAP_WORDSZ;
+    }
+  }
+  else
+  { /* Block fits in one word, probe each aligned slot of it */
+    uint64_t blkmask = (1ULL << blksz) - 1;
+
+    for (wit = nd->fp_hint; wit < endword; wit++)
+    {
+      if (mp->fp_map[wit] == ~0ULL)
+        continue;
+
+      for (bit = 0; bit < MEMPHY_MAP_WORDSZ; bit += blksz)
+        if ((mp->fp_map[wit] & (blkmask << bit)) == 0)
+          return wit * MEMPHY_MAP_WORDSZ + bit;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ *  __memphy_get_order - take the first free 2^order block of the nodes
+ */
+static int __memphy_get_order(struct memphy_struct *mp, int order, int *retfpn)
+{
+  int home = MEMPHY_home_node(mp);
+  struct memphy_node *nd;
+  int nit, fpn;
+
+  for (nit = 0; nit < mp->nnodes; nit++)
+  {
+    nd = &mp->nodes[(home + nit) % mp->nnodes];
+
+    pthread_mutex_lock(&nd->lock);
+    fpn = __memphy_get_block(mp, nd, order);
+    if (fpn >= 0)
+    {
+      __memphy_mark_block(mp, nd, fpn, order, 1);
+      if (nit == 0)
+        nd->alloc_local += 1 << order;
+      else
+        nd->alloc_remote += 1 << order;
+      pthread_mutex_unlock(&nd->lock);
+
+      *retfpn = fpn;
+      return 0;
+    }
+    pthread_mutex_unlock(&nd->lock);
+  }
+
+  return -1;
+}
+
+/*
+ *  MEMPHY_try_freefp_order - get 2^order physically contiguous frames
+ *  @mp: memphy struct
+ *  @order: block order, upto MEMPHY_MAX_ORDER
+ *  @retfpn: first frame of the block
+ *
+ *  Blocks are aligned to their size like buddy blocks. The frame map is
+ *  the single source of truth: taking a block out of a larger free span
+ *  splits it, and releasing frames coalesces with their free buddies
+ *  simply by clearing bits, so no per-order free lists are kept. A block
+ *  never crosses a node, the home node of the calling CPU goes first.
+ *  For callers with a fallback to smaller blocks, the magazines are left
+ *  as they are.
+ *  return 0 if success, -1 if there no free block of that order
+ */
+int MEMPHY_try_freefp_order(struct memphy_struct *mp, int order, int *retfpn)
+{
+  if (order < 0 || order > MEMPHY_MAX_ORDER)
+    return -1;
+
+  return __memphy_get_order(mp, order, retfpn);
+}
+
+/*
+ *  MEMPHY_get_freefp_order - get a 2^order block that must be found
+ *  Like MEMPHY_try_freefp_order, but frames cached by the magazines go
+ *  back to their node first when that would make up the block.
+ */
+int MEMPHY_get_freefp_order(struct memphy_struct *mp, int order, int *retfpn)
+{
+  if (MEMPHY_try_freefp_order(mp, order, retfpn) == 0)
+    return 0;
+
+#ifdef MM_MAGAZINE
+  if (mp->mags != NULL && order >= 0 && order <= MEMPHY_MAX_ORDER &&
+      __memphy_mag_holds_block(mp, order))
+  {
+    __memphy_mag_drain(mp);
+    return __memphy_get_order(mp, order, retfpn);
+  }
+#endif
+  return -1;
+}
+
+/*
+ *  MEMPHY_put_freefp_order - release a block got by MEMPHY_get_freefp_order
+ *  @mp: memphy struct
+ *  @fpn: first frame of the block
+ *  @order: block order
+ *  return -1 and leave the maps alone if a frame of it is free already
+ */
+int MEMPHY_put_freefp_order(struct memphy_struct *mp, int fpn, int order)
+{
+  struct memphy_node *nd;
+  int fpit;
+
+  if (order < 0 || order > MEMPHY_MAX_ORDER ||
+      fpn < 0 || fpn % (1 << order) != 0 || fpn + (1 << order) > mp->maxfp)
+    return -1;
+
+  nd = __memphy_node(mp, fpn);
+  pthread_mutex_lock(&nd->lock);
+  for (fpit = fpn; fpit < fpn + (1 << order); fpit++)
+    if (fpit >= nd->end_fp ||
+        !(mp->fp_map[MEMPHY_MAP_WORD(fpit)] & MEMPHY_MAP_MASK(fpit)) ||
+        (mp->cached_fp_map != NULL &&
+         (mp->cached_fp_map[MEMPHY_MAP_WORD(fpit)] & MEMPHY_MAP_MASK(fpit))))
+    {
+      pthread_mutex_unlock(&nd->lock);
+      return -1;
+    }
+
+  __memphy_mark_block(mp, nd, fpn, order, 0);
+  for (fpit = fpn; fpit < fpn + (1 << order); fpit++)
+  {
+    __sync_fetch_and_and(&mp->used_fp_map[MEMPHY_MAP_WORD(fpit)], ~MEMPHY_MAP_MASK(fpit));
+    __memphy_dirty(mp, fpit);
+    mp->fp_remote[fpit] = 0;
+  }
+  pthread_mutex_unlock(&nd->lock);
+
+  return 0;
+}
+
+/*
+ *  MEMPHY_dump - append the frames changed since the last dump
+ *  @mp: memphy struct
+ *
+ *  The dump file stays open, MEMPHY_DUMP_FILE is written once with
+ *  a header {MEMPHY_DUMP_MAGIC, PAGING_PAGESZ, maxfp}, every dump adds
+ *  a record {seq, time slot, entries..., MEMPHY_DUMP_END}. An entry is
+ *  the frame number followed by its PAGING_PAGESZ bytes, or the frame
+ *  number with MEMPHY_DUMP_FREE set once the frame was released. All
+ *  words are host order uint32_t, MEMPHY_dump_view replays the file.
+ *
+ *  Dirty bits are taken word by word, a frame written meanwhile shows
+ *  up again in the next record. Only the device lock is held, to keep
+ *  records whole.
+ */
+int MEMPHY_dump(struct memphy_struct *mp)
+{
+  uint32_t rec[3], ent;
+  uint64_t dirty;
+  int word, fpn, nchanged = 0;
+
+  if (mp == NULL || mp->dirty_fp_map == NULL)
+    return -1;
+
+  pthread_mutex_lock(&mp->lock);
+  mp->dump_seq++;
+
+  for (word = 0; word < MEMPHY_MAP_NWORDS(mp->maxfp); word++)
+  {
+    if (mp->dirty_fp_map[word] == 0)
+      continue;
+    dirty = __sync_fetch_and_and(&mp->dirty_fp_map[word], 0);
+
+    if (mp->file == NULL)
+    {
+      if ((mp->file = fopen(MEMPHY_DUMP_FILE, "wb")) == NULL)
+      {
+        pthread_mutex_unlock(&mp->lock);
+        return -1;
+      }
+      rec[0] = MEMPHY_DUMP_MAGIC;
+      rec[1] = PAGING_PAGESZ;
+      rec[2] = mp->maxfp;
+      fwrite(rec, sizeof(uint32_t), 3, mp->file);
+    }
+    if (nchanged == 0)
+    {
+      rec[0] = mp->dump_seq;
+      rec[1] = current_time();
+      fwrite(rec, sizeof(uint32_t), 2, mp->file);
+    }
+
+    for (; dirty != 0; dirty &= dirty - 1)
+    {
+      fpn = word * MEMPHY_MAP_WORDSZ + __builtin_ctzll(dirty);
+      if (mp->used_fp_map[word] & MEMPHY_MAP_MASK(fpn))
+      {
+        ent = fpn;
+        fwrite(&ent, sizeof(uint32_t), 1, mp->file);
+        fwrite(mp->storage + fpn * PAGING_PAGESZ, 1, PAGING_PAGESZ, mp->file);
+      }
+      else
+      {
+        ent = fpn | MEMPHY_DUMP_FREE;
+        fwrite(&ent, sizeof(uint32_t), 1, mp->file);
+      }
+      nchanged++;
+    }
+  }
+
+  if (nchanged > 0)
+  {
+    ent = MEMPHY_DUMP_END;
+    fwrite(&ent, sizeof(uint32_t), 1, mp->file);
+    fflush(mp->file);
+  }
+
+  pthread_mutex_unlock(&mp->lock);
+  return 0;
+}
+
+/*
+ *  MEMPHY_dump_view - print the device content a dump file recorded
+ *  @path: file written by MEMPHY_dump
+ *  @seq: last record to replay, -1 for all of them
+ *
+ *  Frames are printed the way the text dump used to, the ones changed
+ *  by the last record replayed are marked with a '*'.
+ */
+int MEMPHY_dump_view(const char *path, int seq)
+{
+  FILE *file = fopen(path, "rb");
+  uint32_t hdr[3], rec[2], ent;
+  BYTE *storage;
+  uint64_t *used, *changed;
+  int fpn, off;
+
+  if (file == NULL)
+    return -1;
+
+  if (fread(hdr, sizeof(uint32_t), 3, file) != 3 ||
+      hdr[0] != MEMPHY_DUMP_MAGIC || hdr[1] != PAGING_PAGESZ)
+  {
+    fclose(file);
+    return -1;
+  }
+
+  storage = calloc(hdr[2], PAGING_PAGESZ);
+  used = calloc(MEMPHY_MAP_NWORDS(hdr[2]), sizeof(uint64_t));
+  changed = calloc(MEMPHY_MAP_NWORDS(hdr[2]), sizeof(uint64_t));
+
+  while (fread(rec, sizeof(uint32_t), 2, file) == 2)
+  {
+    if (seq >= 0 && rec[0] > (uint32_t)seq)
+      break;
+    memset(changed, 0, MEMPHY_MAP_NWORDS(hdr[2]) * sizeof(uint64_t));
+
+    while (fread(&ent, sizeof(uint32_t), 1, file) == 1 && ent != MEMPHY_DUMP_END)
+    {
+      fpn = ent & ~MEMPHY_DUMP_FREE;
+      if (fpn >= (int)hdr[2])
+        break;
+      changed[MEMPHY_MAP_WORD(fpn)] |= MEMPHY_MAP_MASK(fpn);
+
+      if (ent & MEMPHY_DUMP_FREE)
+        used[MEMPHY_MAP_WORD(fpn)] &= ~MEMPHY_MAP_MASK(fpn);
+      else
+      {
+        used[MEMPHY_MAP_WORD(fpn)] |= MEMPHY_MAP_MASK(fpn);
+        if (fread(storage + fpn * PAGING_PAGESZ, 1, PAGING_PAGESZ, file) != PAGING_PAGESZ)
+          break;
+      }
+    }
+    printf("Dump %u at time slot %u\n", rec[0], rec[1]);
+  }
+
+  for (fpn = 0; fpn < (int)hdr[2]; fpn++)
+  {
+    if (!(used[MEMPHY_MAP_WORD(fpn)] & MEMPHY_MAP_MASK(fpn)))
+      continue;
+    printf("\t\t Frame %d%s", fpn,
+           (changed[MEMPHY_MAP_WORD(fpn)] & MEMPHY_MAP_MASK(fpn)) ? " *" : "");
+    for (off = 0; off < PAGING_PAGESZ; ++off)
+    {
+      if (off % 32 == 0)
+        printf("\n");
+      printf("%d ", storage[fpn * PAGING_PAGESZ + off]);
+    }
+    printf("\n");
+  }
+
+  free(storage);
+  free(used);
+  free(changed);
+  fclose(file);
+  return 0;
+}
+
+int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn)
+{
+  struct memphy_node *nd;
+
+  if (fpn < 0 || fpn >= mp->maxfp)
+    return -1;
+
+#ifdef MM_MAGAZINE
+  /* A frame still taken is ours alone until it is cached, a frame
+   * cached already was freed twice */
+  if (mp->mags != NULL && (mp->fp_map[MEMPHY_MAP_WORD(fpn)] & MEMPHY_MAP_MASK(fpn)))
+  {
+    if (__sync_fetch_and_or(&mp->cached_fp_map[MEMPHY_MAP_WORD(fpn)], MEMPHY_MAP_MASK(fpn)) &
+        MEMPHY_MAP_MASK(fpn))
+      return -1;
+
+    __sync_fetch_and_and(&mp->used_fp_map[MEMPHY_MAP_WORD(fpn)], ~MEMPHY_MAP_MASK(fpn));
+    __memphy_dirty(mp, fpn);
+    mp->fp_refcnt[fpn] = 0;
+    mp->fp_remote[fpn] = 0;
+
+    if (__memphy_mag_put(mp, fpn) == 0)
+      return 0;
+    __memphy_mag_mark(mp, 1, &fpn, 0);
+  }
+#endif
+
+  nd = __memphy_node(mp, fpn);
+  __sync_fetch_and_add(&mp->free_fp_cnt, __memphy_put_batch(mp, nd, 1, &fpn));
+
+  return 0;
+}
+
+/*
+ *  MEMPHY_ref_frame - add one more PTE sharing the frame
+ *  @mp: memphy struct
+ *  @fpn: frame number
+ *  return the number of sharers
+ */
+int MEMPHY_ref_frame(struct memphy_struct *mp, int fpn)
+{
+  struct memphy_node *nd;
+  int ref;
+
+  if (fpn < 0 || fpn >= mp->maxfp)
+    return -1;
+
+  nd = __memphy_node(mp, fpn);
+  pthread_mutex_lock(&nd->lock);
+  /* A private frame becomes shared by its owner and the new PTE */
+  mp->fp_refcnt[fpn] = (mp->fp_refcnt[fpn] == 0) ? 2 : mp->fp_refcnt[fpn] + 1;
+  ref = mp->fp_refcnt[fpn];
+  pthread_mutex_unlock(&nd->lock);
+
+  return ref;
+}
+
+/*
+ *  MEMPHY_unref_frame - drop one PTE sharing the frame
+ *  @mp: memphy struct
+ *  @fpn: frame number
+ *  return the number of PTEs still mapping it, 0 for a private frame
+ */
+int MEMPHY_unref_frame(struct memphy_struct *mp, int fpn)
+{
+  struct memphy_node *nd;
+  int ref;
+
+  if (fpn < 0 || fpn >= mp->maxfp)
+    return -1;
+
+  nd = __memphy_node(mp, fpn);
+  pthread_mutex_lock(&nd->lock);
+  if (mp->fp_refcnt[fpn] > 0)
+    mp->fp_refcnt[fpn]--;
+  ref = mp->fp_refcnt[fpn];
+  pthread_mutex_unlock(&nd->lock);
+
+  return ref;
+}
+
+int MEMPHY_get_refcnt(struct memphy_struct *mp, int fpn)
+{
+  if (fpn < 0 || fpn >= mp->maxfp)
+    return -1;
+
+  return mp->fp_refcnt[fpn];
+}
+
+/*
+ *  MEMPHY_put_usedfp - mark a taken frame as holding live data
+ *  used_fp_map words change atomically, frames freed into a magazine
+ *  clear their bit without a node lock.
+ */
+int MEMPHY_put_usedfp(struct memphy_struct *mp, int fpn)
+{
+  if (fpn < 0 || fpn >= mp->maxfp)
+    return -1;
+
+  __sync_fetch_and_or(&mp->used_fp_map[MEMPHY_MAP_WORD(fpn)], MEMPHY_MAP_MASK(fpn));
+  __memphy_dirty(mp, fpn);
+
+  return 0;
+}
+
+/*
+ *  __memphy_storage - get @size bytes of device storage
+ *  @path: file keeping the content, NULL for host memory
+ *
+ *  Mapped storage is zero pages until written, the host only backs the
+ *  frames the simulation touches. A file is left sparse the same way.
+ */
+static BYTE *__memphy_storage(int size, const char *path)
+{
+#ifdef MM_MMAP_STORAGE
+  void *storage;
+  int fd;
+
+  if (size <= 0)
+    return NULL;
+
+  if (path == NULL)
+    storage = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  else
+  {
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+      return NULL;
+    if (ftruncate(fd, size) != 0)
+    {
+      close(fd);
+      return NULL;
+    }
+    storage = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+  }
+
+  return (storage == MAP_FAILED) ? NULL : storage;
+#else
+  return (path == NULL) ? (BYTE *)malloc(size * sizeof(BYTE)) : NULL;
+#endif
+}
+
+/*
+ *  Init MEMPHY struct
+ */
+int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
+{
+  return init_memphy_file(mp, max_size, randomflg, NULL);
+}
+
+/*
+ *  init_memphy_file - init a MEMPHY whose content lives in a file
+ *  @path: the file, created if needed, NULL to keep it in host memory
+ *  Return -1 if the storage cannot be set up, the device is then empty.
+ */
+int init_memphy_file(struct memphy_struct *mp, int max_size, int randomflg, const char *path)
+{
+  int failed;
+
+  mp->storage = __memphy_storage(max_size, path);
+  mp->storage_shared = (path != NULL);
+  failed = (mp->storage == NULL && max_size > 0);
+  mp->maxsz = (mp->storage != NULL) ? max_size : 0;
+  mp->cursor = 0;
+  mp->seek_bytes = 0;
+  mp->file = NULL;
+  mp->dump_seq = 0;
+  pthread_mutex_init(&mp->lock, NULL);
+
+  MEMPHY_format(mp, PAGING_PAGESZ);
+
+  mp->rdmflg = (randomflg != 0) ? 1 : 0;
+
+  return failed ? -1 : 0;
+}
+
+/*
+ *  free_memphy - give back the storage and maps of a device
+ *  @mp: memphy struct set up by one of the init_memphy calls
+ */
+void free_memphy(struct memphy_struct *mp)
+{
+  int it;
+
+#ifdef MM_MMAP_STORAGE
+  if (mp->storage != NULL)
+    munmap(mp->storage, mp->maxsz);
+#else
+  free(mp->storage);
+#endif
+  mp->storage = NULL;
+
+  free(mp->fp_map);
+  free(mp->fp_summary);
+  free(mp->used_fp_map);
+  free(mp->dirty_fp_map);
+  free(mp->fp_refcnt);
+  free(mp->fp_remote);
+  free(mp->cached_fp_map);
+  for (it = 0; mp->mags != NULL && it < mp->nmags; it++)
+    pthread_mutex_destroy(&mp->mags[it].lock);
+  free(mp->mags);
+  for (it = 0; it < mp->nnodes; it++)
+    pthread_mutex_destroy(&mp->nodes[it].lock);
+  free(mp->nodes);
+
+  if (mp->file != NULL)
+    fclose(mp->file);
+  pthread_mutex_destroy(&mp->lock);
+}
+
+/*
+ *  init_memphy_nodes - init a MEMPHY split in @nnodes nodes
+ *  @mp: memphy struct
+ *  @nnodes: number of nodes, upto MEMPHY_MAX_NODES
+ *  @nodesz: size of each node
+ *  @randomflg: random access device
+ *
+ *  Each node but the last is padded to a whole frame map word, the
+ *  padding frames are marked taken and belong to no allocation.
+ *  Return -1 if the storage cannot be set up, like init_memphy_file.
+ */
+int init_memphy_nodes(struct memphy_struct *mp, int nnodes, int *nodesz, int randomflg)
+{
+  struct memphy_node *nd;
+  int nid, nfp, start, fpit;
+
+  if (nnodes < 1 || nnodes > MEMPHY_MAX_NODES)
+    return -1;
+
+  for (nid = 0, start = 0; nid < nnodes; nid++)
+  {
+    nfp = nodesz[nid] / PAGING_PAGESZ;
+    start += (nid < nnodes - 1) ? MEMPHY_MAP_NWORDS(nfp) * MEMPHY_MAP_WORDSZ : nfp;
+  }
+
+  if (init_memphy(mp, start * PAGING_PAGESZ, randomflg) != 0)
+    return -1;
+  if (nnodes == 1)
+    return 0;
+
+  pthread_mutex_destroy(&mp->nodes[0].lock);
+  free(mp->nodes);
+  mp->nnodes = nnodes;
+  mp->nodes = calloc(nnodes, sizeof(struct memphy_node));
+
+  for (nid = 0, start = 0; nid < nnodes; nid++)
+  {
+    nd = &mp->nodes[nid];
+    nfp = nodesz[nid] / PAGING_PAGESZ;
+
+    nd->start_fp = start;
+    nd->end_fp = start + nfp;
+    nd->free_fp_cnt = nfp;
+    nd->fp_hint = MEMPHY_MAP_WORD(start);
+    pthread_mutex_init(&nd->lock, NULL);
+
+    if (nid == nnodes - 1)
+      break;
+
+    start += MEMPHY_MAP_NWORDS(nfp) * MEMPHY_MAP_WORDSZ;
+    for (fpit = nd->end_fp; fpit < start; fpit++)
+    {
+      mp->fp_map[MEMPHY_MAP_WORD(fpit)] |= MEMPHY_MAP_MASK(fpit);
+      __memphy_summary(mp, MEMPHY_MAP_WORD(fpit));
+      mp->free_fp_cnt--;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ *  MEMPHY_print_nodes - report the frames of each node
+ */
+void MEMPHY_print_nodes(struct memphy_struct *mp)
+{
+  struct memphy_node *nd;
+  int nid;
+
+  for (nid = 0; nid < mp->nnodes; nid++)
+  {
+    nd = &mp->nodes[nid];
+    printf("MEMRAM node %d: frames %d-%d, %d free, %lu allocated local, %lu remote\n",
+           nid, nd->start_fp, nd->end_fp - 1, nd->free_fp_cnt,
+           nd->alloc_local, nd->alloc_remote);
+  }
+}
+
+/*
+ *  MEMPHY_save - write a device to a checkpoint
+ *  @file: checkpoint file
+ *  @mp: memphy struct
+ *
+ *  Frames cached by the CPUs go back to their node first, the maps then
+ *  tell alone which frames are free. The content starts on a host page
+ *  so MEMPHY_restore can map it.
+ */
+int MEMPHY_save(FILE *file, struct memphy_struct *mp)
+{
+  int hdr[5] = {mp->maxsz, mp->maxfp, mp->nnodes, mp->free_fp_cnt, mp->cursor};
+  int nwords = MEMPHY_MAP_NWORDS(mp->maxfp);
+  int nid;
+
+#ifdef MM_MAGAZINE
+  __memphy_mag_drain(mp);
+#endif
+
+  ckpt_write(file, hdr, sizeof(hdr));
+  for (nid = 0; nid < mp->nnodes; nid++)
+  {
+    ckpt_write(file, &mp->nodes[nid].free_fp_cnt, sizeof(int));
+    ckpt_write(file, &mp->nodes[nid].fp_hint, sizeof(int));
+  }
+
+  if (mp->maxfp == 0)
+    return 0;
+
+  ckpt_write(file, mp->fp_map, nwords * sizeof(uint64_t));
+  ckpt_write(file, mp->fp_summary, MEMPHY_MAP_NWORDS(nwords) * sizeof(uint64_t));
+  ckpt_write(file, mp->used_fp_map, nwords * sizeof(uint64_t));
+  ckpt_write(file, mp->fp_refcnt, mp->maxfp * sizeof(int));
+  ckpt_write(file, mp->fp_remote, mp->maxfp * sizeof(int));
+
+  ckpt_write_align(file);
+  ckpt_write_sparse(file, mp->storage, mp->maxsz);
+
+  return 0;
+}
+
+/*
+ *  MEMPHY_restore - load a device saved by MEMPHY_save
+ *  @img: checkpoint being read
+ *  @mp: memphy struct, set up with the size it was saved with
+ *
+ *  The content is mapped copy-on-write from the checkpoint, a frame is
+ *  read from it only once the simulation touches it. A device kept in a
+ *  file of its own gets a plain copy.
+ */
+int MEMPHY_restore(struct ckpt_image *img, struct memphy_struct *mp)
+{
+  int hdr[5], nd[2];
+  int nwords = MEMPHY_MAP_NWORDS(mp->maxfp);
+  int nid;
+
+  if (ckpt_read(img, hdr, sizeof(hdr)) != 0 || hdr[0] != mp->maxsz ||
+      hdr[1] != mp->maxfp || hdr[2] != mp->nnodes)
+    return -1;
+
+  mp->free_fp_cnt = hdr[3];
+  mp->cursor = hdr[4];
+  for (nid = 0; nid < mp->nnodes; nid++)
+  {
+    if (ckpt_read(img, nd, sizeof(nd)) != 0)
+      return -1;
+    mp->nodes[nid].free_fp_cnt = nd[0];
+    mp->nodes[nid].fp_hint = nd[1];
+  }
+
+  if (mp->maxfp == 0)
+    return 0;
+
+  if (ckpt_read(img, mp->fp_map, nwords * sizeof(uint64_t)) != 0 ||
+      ckpt_read(img, mp->fp_summary, MEMPHY_MAP_NWORDS(nwords) * sizeof(uint64_t)) != 0 ||
+      ckpt_read(img, mp->used_fp_map, nwords * sizeof(uint64_t)) != 0 ||
+      ckpt_read(img, mp->fp_refcnt, mp->maxfp * sizeof(int)) != 0 ||
+      ckpt_read(img, mp->fp_remote, mp->maxfp * sizeof(int)) != 0)
+    return -1;
+
+  /* The first dump after a restore records the whole device */
+  memcpy(mp->dirty_fp_map, mp->used_fp_map, nwords * sizeof(uint64_t));
+
+  if (ckpt_read_align(img) != 0 || img->off + mp->maxsz > img->size)
+    return -1;
+
+#ifdef MM_MMAP_STORAGE
+  if (mp->storage_shared ||
+      mmap(mp->storage, mp->maxsz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+           img->fd, img->off) == MAP_FAILED)
+#endif
+    memcpy(mp->storage, img->base + img->off, mp->maxsz);
+  img->off += mp->maxsz;
 
   return 0;
 }
@@ -0,0 +1,122 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * MEMRAM nodes mm-numa.c
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef MM_NUMA_REMOTE_COST
+/*
+ *  MEMRAM may be split in nodes, a CPU allocates from its home node
+ *  first. Reaching a frame of another node stalls the CPU for
+ *  MM_NUMA_REMOTE_COST more time slots, a private page reached that way
+ *  MM_NUMA_MIGRATE times is moved to the node of the CPU using it.
+ */
+static __thread int numa_stall_slots;
+
+static unsigned long numa_local_cnt;
+static unsigned long numa_remote_cnt;
+static unsigned long numa_migrate_cnt;
+
+#ifdef MM_NUMA_MIGRATE
+/*
+ *  numa_migrate - move @pgn of @caller from frame @fpn to node @nid
+ *  Return the frame now holding the page.
+ *
+ *  Only a private base page moves and only to a free frame, nothing is
+ *  evicted for it. The PTE keeps its bits, its swap slot still matches.
+ */
+static int numa_migrate(struct pcb_t *caller, int pgn, int fpn, int nid)
+{
+  struct mm_struct *mm = caller->mm;
+  uint32_t pte = mm->pgd[pgn];
+  int newfpn;
+
+  if (!PAGING_PAGE_PRESENT(pte) || PAGING_PAGE_HUGE(pte) || PAGING_FPN(pte) != fpn ||
+      PAGING_PAGE_COW(pte) || MEMPHY_get_refcnt(caller->mram, fpn) > 1)
+    return fpn;
+#ifdef MM_HUGEPAGE
+  if (PAGING_PAGE_HUGE(mm->pgd[PAGING_HUGE_PGN(pgn)]))
+    return fpn;
+#endif
+  if (shm_find(mm, pgn))
+    return fpn;
+
+  if (MEMPHY_get_freefp_node(caller->mram, nid, &newfpn) != 0)
+    return fpn;
+
+  MEMPHY_put_usedfp(caller->mram, newfpn);
+  MEMPHY_cp_frame(caller->mram, fpn, caller->mram, newfpn);
+
+  SETVAL(mm->pgd[pgn], newfpn, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT);
+  tlb_flush_page(caller->pid, pgn);
+  tlb_update(caller, pgn, newfpn);
+
+  MEMPHY_put_freefp(caller->mram, fpn);
+  __sync_fetch_and_add(&numa_migrate_cnt, 1);
+
+  return newfpn;
+}
+#endif
+
+/*
+ *  numa_access - charge an access of @caller to frame @fpn
+ *  @pgn: page mapped on it
+ *  Return the frame to access, another one if the page just moved.
+ */
+int numa_access(struct pcb_t *caller, int pgn, int fpn)
+{
+  struct memphy_struct *mram = caller->mram;
+  int nid;
+
+  if (mram->nnodes <= 1)
+    return fpn;
+
+  nid = MEMPHY_home_node(mram);
+  if (MEMPHY_node_of(mram, fpn) == nid)
+  {
+    __sync_fetch_and_add(&numa_local_cnt, 1);
+    return fpn;
+  }
+
+  __sync_fetch_and_add(&numa_remote_cnt, 1);
+  numa_stall_slots += MM_NUMA_REMOTE_COST;
+
+#ifdef MM_NUMA_MIGRATE
+  if (__sync_add_and_fetch(&mram->fp_remote[fpn], 1) >= MM_NUMA_MIGRATE)
+    return numa_migrate(caller, pgn, fpn, nid);
+#endif
+
+  return fpn;
+}
+
+/*
+ *  numa_stall - time slots the calling CPU owes for remote accesses
+ *  The debt is cleared, the CPU is expected to sit them out.
+ */
+int numa_stall(void)
+{
+  int stall = numa_stall_slots;
+
+  numa_stall_slots = 0;
+  return stall;
+}
+
+/*
+ *  print_numa_stats - report the locality of MEMRAM accesses
+ */
+void print_numa_stats(struct memphy_struct *mram)
+{
+  if (mram->nnodes <= 1)
+    return;
+
+  MEMPHY_print_nodes(mram);
+  printf("NUMA: %lu local accesses, %lu remote accesses, %lu pages migrated\n",
+         numa_local_cnt, numa_remote_cnt, numa_migrate_cnt);
+}
+#endif
+
+// #endif
@@ -0,0 +1,532 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Shared memory segments mm-shm.c
+ */
+
+#include "mm.h"
+#include "checkpoint.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ *  Segments are named by a key and outlive the processes that attach
+ *  them, their content goes with the last one to detach. A page of a
+ *  segment is either in one MEMRAM frame, mapped by every attached PTE
+ *  that touched it, or in one swap slot. Evicting it walks the reverse
+ *  map so no mapper keeps a stale frame.
+ */
+static struct shm_struct *shm_segs;
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct shm_struct *shm_find_seg(uint32_t key)
+{
+  struct shm_struct *shm;
+
+  for (shm = shm_segs; shm != NULL; shm = shm->shm_next)
+    if (shm->key == key)
+      return shm;
+
+  return NULL;
+}
+
+/*
+ *  shm_find_att - find the attachment of @mm mapping @pgn
+ *  @idx: return the page index inside the segment
+ */
+static struct shm_attach_struct *shm_find_att(struct mm_struct *mm, int pgn, int *idx)
+{
+  struct shm_attach_struct *att;
+
+  for (att = mm->shm_list; att != NULL; att = att->att_next)
+    if (pgn >= att->pgn && pgn < att->pgn + att->shm->npages)
+    {
+      if (idx != NULL)
+        *idx = pgn - att->pgn;
+      return att;
+    }
+
+  return NULL;
+}
+
+static struct shm_attach_struct *shm_new_att(struct shm_struct *shm,
+                                             struct mm_struct *mm, uint32_t pid, int pgn)
+{
+  struct shm_attach_struct *att = malloc(sizeof(struct shm_attach_struct));
+
+  att->shm = shm;
+  att->mm = mm;
+  att->pid = pid;
+  att->pgn = pgn;
+
+  att->att_next = mm->shm_list;
+  mm->shm_list = att;
+  att->rmap_next = shm->rmap;
+  shm->rmap = att;
+
+  return att;
+}
+
+/* Map the pages of the segment already in MEMRAM, the others fault in */
+static void shm_map_att(struct shm_attach_struct *att)
+{
+  struct mm_struct *mm = att->mm;
+  int pgit;
+
+  for (pgit = 0; pgit < att->shm->npages; pgit++)
+  {
+    if (att->shm->fpn[pgit] < 0)
+      continue;
+
+    pte_set_fpn(&mm->pgd[att->pgn + pgit], att->shm->fpn[pgit]);
+    enlist_pgn_node(&mm->fifo_pgn, att->pgn + pgit);
+  }
+}
+
+/*
+ *  shm_unmap_att - drop the mapping @att, the last one frees the pages
+ *  @caller: owner of the devices, NULL to leave the pages where they are
+ */
+static void shm_unmap_att(struct shm_attach_struct *att, struct pcb_t *caller)
+{
+  struct mm_struct *mm = att->mm;
+  struct shm_struct *shm = att->shm;
+  struct shm_attach_struct **link;
+  int pgit;
+
+  for (pgit = 0; pgit < shm->npages; pgit++)
+  {
+    mm->pgd[att->pgn + pgit] = 0;
+    remove_pgn_node(&mm->fifo_pgn, att->pgn + pgit);
+    tlb_flush_page(att->pid, att->pgn + pgit);
+  }
+
+  for (link = &mm->shm_list; *link != att; link = &(*link)->att_next);
+  *link = att->att_next;
+  for (link = &shm->rmap; *link != att; link = &(*link)->rmap_next);
+  *link = att->rmap_next;
+
+  free(att);
+
+  for (pgit = 0; caller != NULL && shm->rmap == NULL && pgit < shm->npages; pgit++)
+  {
+    if (shm->fpn[pgit] >= 0)
+      MEMPHY_put_freefp(caller->mram, shm->fpn[pgit]);
+    if (shm->swpslot[pgit] >= 0)
+      swp_put_slot(caller, shm->swpslot[pgit]);
+    shm->fpn[pgit] = shm->swpslot[pgit] = -1;
+  }
+}
+
+/*
+ *  pgshmget - create the shared segment @key unless it exists
+ *  @proc: process executing the instruction
+ *  @key:  segment name
+ *  @size: segment size, rounded up to whole pages
+ */
+int pgshmget(struct pcb_t *proc, uint32_t key, uint32_t size)
+{
+  struct shm_struct *shm;
+  int pgit;
+
+  if (size == 0)
+    return -1;
+
+  pthread_mutex_lock(&shm_lock);
+  if (shm_find_seg(key) == NULL)
+  {
+    shm = malloc(sizeof(struct shm_struct));
+    shm->key = key;
+    shm->npages = DIV_ROUND_UP(size, PAGING_PAGESZ);
+    shm->fpn = malloc(shm->npages * sizeof(int));
+    shm->swpslot = malloc(shm->npages * sizeof(int));
+    for (pgit = 0; pgit < shm->npages; pgit++)
+      shm->fpn[pgit] = shm->swpslot[pgit] = -1;
+    shm->rmap = NULL;
+
+    shm->shm_next = shm_segs;
+    shm_segs = shm;
+    printf("\tProcess %d created shared segment %u of %d pages\n",
+           proc->pid, key, shm->npages);
+  }
+  pthread_mutex_unlock(&shm_lock);
+
+  return 0;
+}
+
+/*
+ *  pgshmat - map the shared segment @key as region @reg_index
+ *  @proc:      process executing the instruction
+ *  @key:       segment name
+ *  @reg_index: symbol table entry of the mapping
+ *
+ *  The mapping takes fresh page aligned space at the break.
+ */
+int pgshmat(struct pcb_t *proc, uint32_t key, uint32_t reg_index)
+{
+  struct vm_area_struct *cur_vma = get_vma_by_num(proc->mm, 0);
+  struct shm_struct *shm;
+  int start, end;
+
+  if (reg_index >= PAGING_MAX_SYMTBL_SZ || cur_vma == NULL)
+    return -1;
+
+  pthread_mutex_lock(&shm_lock);
+  if ((shm = shm_find_seg(key)) == NULL)
+  {
+    pthread_mutex_unlock(&shm_lock);
+    return -1;
+  }
+
+  /* A segment is backed a frame per page, a heap huge fault steps around it */
+  start = PAGING_PAGE_ALIGNSZ(cur_vma->sbrk);
+  end = start + shm->npages * PAGING_PAGESZ;
+  if (PAGING_PGN((end - 1)) >= PAGING_MAX_PGN)
+  {
+    pthread_mutex_unlock(&shm_lock);
+    return -1;
+  }
+
+  cur_vma->sbrk = end;
+  if (cur_vma->vm_end < end)
+    cur_vma->vm_end = end;
+
+  shm_map_att(shm_new_att(shm, proc->mm, proc->pid, PAGING_PGN(start)));
+  pthread_mutex_unlock(&shm_lock);
+
+  proc->mm->symrgtbl[reg_index].rg_start = start;
+  proc->mm->symrgtbl[reg_index].rg_end = start + shm->npages * PAGING_PAGESZ;
+
+  return 0;
+}
+
+/*
+ *  shm_detach - unmap the segment attached at @rg_start
+ *  Return 0 if a segment was unmapped, 1 if none is attached there.
+ */
+int shm_detach(struct pcb_t *caller, int rg_start)
+{
+  struct shm_attach_struct *att;
+
+  if (caller->mm->shm_list == NULL)
+    return 1;
+
+  pthread_mutex_lock(&shm_lock);
+  att = shm_find_att(caller->mm, PAGING_PGN(rg_start), NULL);
+  if (att == NULL || att->pgn * PAGING_PAGESZ != rg_start)
+  {
+    pthread_mutex_unlock(&shm_lock);
+    return 1;
+  }
+
+  shm_unmap_att(att, caller);
+  pthread_mutex_unlock(&shm_lock);
+
+  return 0;
+}
+
+/*
+ *  shm_exit - unmap every segment of an exiting process
+ *  @mm:     its mm
+ *  @caller: the process, NULL when its mm never ran, as for an mm being
+ *           restored, then the pages of the segments stay
+ */
+int shm_exit(struct mm_struct *mm, struct pcb_t *caller)
+{
+  pthread_mutex_lock(&shm_lock);
+  while (mm->shm_list != NULL)
+    shm_unmap_att(mm->shm_list, caller);
+  pthread_mutex_unlock(&shm_lock);
+
+  return 0;
+}
+
+/*
+ *  shm_find - tell if @pgn belongs to a shared segment of @mm
+ */
+int shm_find(struct mm_struct *mm, int pgn)
+{
+  int found;
+
+  if (mm->shm_list == NULL)
+    return 0;
+
+  pthread_mutex_lock(&shm_lock);
+  found = shm_find_att(mm, pgn, NULL) != NULL;
+  pthread_mutex_unlock(&shm_lock);
+
+  return found;
+}
+
+/*
+ *  shm_fork - attach the child to every segment of its parent
+ *  @mm:    child mm, its shared pages were left unmapped by copy_mm
+ *  @src:   parent mm
+ *  @child: child process
+ */
+int shm_fork(struct mm_struct *mm, struct mm_struct *src, struct pcb_t *child)
+{
+  struct shm_attach_struct *att;
+
+  pthread_mutex_lock(&shm_lock);
+  for (att = src->shm_list; att != NULL; att = att->att_next)
+    shm_map_att(shm_new_att(att->shm, mm, child->pid, att->pgn));
+  pthread_mutex_unlock(&shm_lock);
+
+  return 0;
+}
+
+/*
+ *  shm_fault - bring a shared page on-line for @caller
+ *  Return 0 once mapped, 1 if @pgn is not shared, -1 on failure.
+ *
+ *  The page may already be in MEMRAM through another mapper, then its
+ *  frame is simply mapped. Otherwise a frame is found outside the lock,
+ *  eviction may need it, and filled from the slot or with zeros.
+ */
+int shm_fault(struct mm_struct *mm, int pgn, struct pcb_t *caller)
+{
+  struct shm_attach_struct *att;
+  struct shm_struct *shm;
+  int idx, newfpn = -1;
+
+  if (mm->shm_list == NULL)
+    return 1;
+
+  pthread_mutex_lock(&shm_lock);
+  while ((att = shm_find_att(mm, pgn, &idx)) != NULL &&
+         att->shm->fpn[idx] < 0 && newfpn < 0)
+  {
+    pthread_mutex_unlock(&shm_lock);
+
+    if (pg_alloc_frame(mm, &newfpn, caller) != 0)
+      return -1;
+
+    pthread_mutex_lock(&shm_lock);
+  }
+
+  if (att == NULL)
+  {
+    pthread_mutex_unlock(&shm_lock);
+    if (newfpn >= 0)
+      MEMPHY_put_freefp(caller->mram, newfpn);
+    return 1;
+  }
+
+  shm = att->shm;
+  if (shm->fpn[idx] < 0)
+  {
+    if (shm->swpslot[idx] >= 0)
+      swp_read_page(caller, shm->swpslot[idx], newfpn);
+    else
+      MEMPHY_zero_frame(caller->mram, newfpn);
+
+    shm->fpn[idx] = newfpn;
+  }
+  else if (newfpn >= 0) /* another mapper was faster */
+    MEMPHY_put_freefp(caller->mram, newfpn);
+
+  pte_set_fpn(&mm->pgd[pgn], shm->fpn[idx]);
+  enlist_pgn_node(&mm->fifo_pgn, pgn);
+  pthread_mutex_unlock(&shm_lock);
+
+  return 0;
+}
+
+/*
+ *  __shm_first_att - @rmit is the first mapping of its mm in the rmap
+ */
+static int __shm_first_att(struct shm_struct *shm, struct shm_attach_struct *rmit)
+{
+  struct shm_attach_struct *it;
+
+  for (it = shm->rmap; it != rmit; it = it->rmap_next)
+    if (it->mm == rmit->mm)
+      return 0;
+  return 1;
+}
+
+/*
+ *  __shm_unlock_mappers - release the mm_lock of the mappers locked
+ *  before @stop, by __shm_lock_mappers
+ */
+static void __shm_unlock_mappers(struct shm_struct *shm, struct mm_struct *own,
+                                 struct shm_attach_struct *stop)
+{
+  struct shm_attach_struct *rmit;
+
+  for (rmit = shm->rmap; rmit != stop; rmit = rmit->rmap_next)
+    if (rmit->mm != own && __shm_first_att(shm, rmit))
+      pthread_mutex_unlock(&rmit->mm->mm_lock);
+}
+
+/*
+ *  __shm_lock_mappers - take the mm_lock of every other mapper of @shm
+ *  @own: mm of the caller, already held
+ *  Return -1, nothing held, if one is busy.
+ */
+static int __shm_lock_mappers(struct shm_struct *shm, struct mm_struct *own)
+{
+  struct shm_attach_struct *rmit;
+
+  for (rmit = shm->rmap; rmit != NULL; rmit = rmit->rmap_next)
+  {
+    if (rmit->mm == own || !__shm_first_att(shm, rmit))
+      continue;
+    if (pthread_mutex_trylock(&rmit->mm->mm_lock) != 0)
+    {
+      __shm_unlock_mappers(shm, own, rmit);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ *  shm_evict_page - push a shared victim out of MEMRAM for all mappers
+ *  @caller: process whose victim it is
+ *  @pgn:    victim page
+ *  @fpn:    its frame
+ *  Return 0 once written out, 1 if @pgn is not shared, 2 if a mapper is
+ *  busy, -1 on failure.
+ *
+ *  The PTEs of the other mappers change under their mm_lock. One that is
+ *  busy, running on another CPU, makes the caller pick another victim
+ *  as kswapd skips it.
+ */
+int shm_evict_page(struct pcb_t *caller, int pgn, int fpn)
+{
+  struct shm_attach_struct *att, *rmit;
+  struct shm_struct *shm;
+  int idx, rpgn;
+
+  if (caller->mm->shm_list == NULL)
+    return 1;
+
+  pthread_mutex_lock(&shm_lock);
+  if ((att = shm_find_att(caller->mm, pgn, &idx)) == NULL)
+  {
+    pthread_mutex_unlock(&shm_lock);
+    return 1;
+  }
+
+  shm = att->shm;
+  if (__shm_lock_mappers(shm, caller->mm) != 0)
+  {
+    pthread_mutex_unlock(&shm_lock);
+    return 2;
+  }
+
+  if (shm->swpslot[idx] < 0 &&
+      swp_get_slot(caller, pgn, &shm->swpslot[idx]) != 0)
+  {
+    shm->swpslot[idx] = -1;
+    __shm_unlock_mappers(shm, caller->mm, NULL);
+    pthread_mutex_unlock(&shm_lock);
+    return -1;
+  }
+
+  swp_write_page(caller, fpn, shm->swpslot[idx]);
+
+  /* Every PTE of the frame now points at the slot */
+  for (rmit = shm->rmap; rmit != NULL; rmit = rmit->rmap_next)
+  {
+    rpgn = rmit->pgn + idx;
+    if (PAGING_PAGE_PRESENT(rmit->mm->pgd[rpgn]))
+    {
+      pte_set_swap(&rmit->mm->pgd[rpgn], PAGING_SWPSLOT_TYP(shm->swpslot[idx]),
+                   PAGING_SWPSLOT_OFF(shm->swpslot[idx]));
+      tlb_flush_page(rmit->pid, rpgn);
+    }
+  }
+  shm->fpn[idx] = -1;
+  remove_pgn_node(&caller->mm->fifo_pgn, pgn);
+  __shm_unlock_mappers(shm, caller->mm, NULL);
+  pthread_mutex_unlock(&shm_lock);
+
+  return 0;
+}
+
+/*
+ *  shm_save - write every segment and its mappers to a checkpoint
+ *  A mapper is saved by PID, its PTEs already went with its mm.
+ */
+void shm_save(FILE *file)
+{
+  struct shm_struct *shm;
+  struct shm_attach_struct *att;
+  uint32_t rec[3];
+
+  for (rec[0] = 0, shm = shm_segs; shm != NULL; shm = shm->shm_next)
+    rec[0]++;
+  ckpt_write(file, rec, sizeof(uint32_t));
+
+  for (shm = shm_segs; shm != NULL; shm = shm->shm_next)
+  {
+    rec[0] = shm->key;
+    rec[1] = shm->npages;
+    for (rec[2] = 0, att = shm->rmap; att != NULL; att = att->rmap_next)
+      rec[2]++;
+    ckpt_write(file, rec, sizeof(rec));
+    ckpt_write(file, shm->fpn, shm->npages * sizeof(int));
+    ckpt_write(file, shm->swpslot, shm->npages * sizeof(int));
+
+    for (att = shm->rmap; att != NULL; att = att->rmap_next)
+    {
+      rec[0] = att->pid;
+      rec[1] = att->pgn;
+      ckpt_write(file, rec, 2 * sizeof(uint32_t));
+    }
+  }
+}
+
+/*
+ *  shm_restore - rebuild the segments saved by shm_save
+ *  The mappers must be restored already.
+ */
+int shm_restore(struct ckpt_image *img)
+{
+  struct shm_struct *shm, **segtail = &shm_segs;
+  struct pcb_t *proc;
+  uint32_t nseg, rec[3], att;
+
+  if (ckpt_read(img, &nseg, sizeof(uint32_t)) != 0)
+    return -1;
+
+  /* Saved in list order, each one goes back at the tail */
+  while (*segtail != NULL)
+    segtail = &(*segtail)->shm_next;
+
+  for (; nseg > 0; nseg--)
+  {
+    if (ckpt_read(img, rec, sizeof(rec)) != 0)
+      return -1;
+
+    shm = malloc(sizeof(struct shm_struct));
+    shm->key = rec[0];
+    shm->npages = rec[1];
+    shm->fpn = malloc(shm->npages * sizeof(int));
+    shm->swpslot = malloc(shm->npages * sizeof(int));
+    shm->rmap = NULL;
+    shm->shm_next = NULL;
+    *segtail = shm;
+    segtail = &shm->shm_next;
+
+    if (ckpt_read(img, shm->fpn, shm->npages * sizeof(int)) != 0 ||
+        ckpt_read(img, shm->swpslot, shm->npages * sizeof(int)) != 0)
+      return -1;
+
+    for (att = rec[2]; att > 0; att--)
+    {
+      if (ckpt_read(img, rec, 2 * sizeof(uint32_t)) != 0 ||
+          (proc = ckpt_find_pcb(rec[0])) == NULL || proc->mm == NULL)
+        return -1;
+      shm_new_att(shm, proc->mm, rec[0], rec[1]);
+    }
+  }
+
+  return 0;
+}
+
+// #endif
@@ -0,0 +1,404 @@
+// #ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Swap device selection mm-swap.c
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ *  An off-line page lives in one of the PAGING_MAX_MMSWP swap devices,
+ *  the SWPTYP field of its PTE names which. Devices configured with no
+ *  space are never picked. A full device passes the page on to the next.
+ */
+static enum swp_policy_t swp_policy = SWP_RR;
+static unsigned long swp_rr_next;
+static unsigned long swp_out_cnt[PAGING_MAX_MMSWP];
+
+static const char *swp_names[] = {"rr", "least", "stripe"};
+
+#ifdef MM_ZSWAP
+/*
+ *  Compressed pool in front of the devices, entries are indexed by the
+ *  slot they stand for. The slot stays reserved on its device, so a page
+ *  the pool cannot keep simply goes where it would have gone anyway.
+ */
+#define ZSWAP_MINRUN 3
+#define ZSWAP_MAXLEN (PAGING_PAGESZ / 2)
+
+struct zswap_entry {
+  int len;
+  BYTE data[];
+};
+
+static struct zswap_entry **zswap_tbl[PAGING_MAX_MMSWP];
+static long zswap_pool_sz;
+static pthread_mutex_t zswap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long zswap_stored;
+static unsigned long zswap_rejected;
+static unsigned long zswap_loaded;
+static unsigned long zswap_in_bytes;
+static unsigned long zswap_out_bytes;
+
+/*
+ *  zswap_compress - run-length code one frame
+ *  A control byte below 0x80 is followed by that many plus one literal
+ *  bytes, one from 0x80 repeats the next byte (c - 0x80 + ZSWAP_MINRUN)
+ *  times. Return the coded length, or -1 past @maxlen.
+ */
+static int zswap_compress(BYTE *src, BYTE *dst, int maxlen)
+{
+  int in = 0, out = 0, run, lit;
+
+  while (in < PAGING_PAGESZ)
+  {
+    for (run = 1; in + run < PAGING_PAGESZ && run < 0x7f + ZSWAP_MINRUN &&
+                  src[in + run] == src[in]; run++);
+
+    if (run >= ZSWAP_MINRUN)
+    {
+      if (out + 2 > maxlen)
+        return -1;
+      dst[out++] = (BYTE)(0x80 + run - ZSWAP_MINRUN);
+      dst[out++] = src[in];
+      in += run;
+      continue;
+    }
+
+    /* Literals up to the next run worth coding */
+    for (lit = 1; in + lit < PAGING_PAGESZ && lit < 0x80; lit++)
+      if (in + lit + ZSWAP_MINRUN <= PAGING_PAGESZ &&
+          src[in + lit] == src[in + lit + 1] && src[in + lit] == src[in + lit + 2])
+        break;
+
+    if (out + 1 + lit > maxlen)
+      return -1;
+    dst[out++] = (BYTE)(lit - 1);
+    memcpy(dst + out, src + in, lit);
+    out += lit;
+    in += lit;
+  }
+
+  return out;
+}
+
+static void zswap_decompress(BYTE *src, int len, BYTE *dst)
+{
+  int in = 0, out = 0, cnt;
+  unsigned char ctl;
+
+  while (in < len && out < PAGING_PAGESZ)
+  {
+    ctl = (unsigned char)src[in++];
+    if (ctl >= 0x80)
+    {
+      cnt = ctl - 0x80 + ZSWAP_MINRUN;
+      memset(dst + out, src[in++], cnt);
+    }
+    else
+    {
+      cnt = ctl + 1;
+      memcpy(dst + out, src + in, cnt);
+      in += cnt;
+    }
+    out += cnt;
+  }
+}
+
+/* Drop the pool copy of @slot, zswap_lock held */
+static void zswap_drop(int slot)
+{
+  struct zswap_entry **tbl = zswap_tbl[PAGING_SWPSLOT_TYP(slot)];
+
+  if (tbl == NULL || tbl[PAGING_SWPSLOT_OFF(slot)] == NULL)
+    return;
+
+  zswap_pool_sz -= tbl[PAGING_SWPSLOT_OFF(slot)]->len;
+  free(tbl[PAGING_SWPSLOT_OFF(slot)]);
+  tbl[PAGING_SWPSLOT_OFF(slot)] = NULL;
+}
+
+/*
+ *  zswap_store - keep the page of @slot compressed in the pool
+ *  Return 0 if kept, -1 if it does not compress or the pool is full.
+ */
+static int zswap_store(struct pcb_t *caller, int slot, BYTE *page)
+{
+  int typ = PAGING_SWPSLOT_TYP(slot);
+  BYTE cbuf[ZSWAP_MAXLEN];
+  struct zswap_entry *ent;
+  int len;
+
+  len = zswap_compress(page, cbuf, ZSWAP_MAXLEN);
+
+  pthread_mutex_lock(&zswap_lock);
+  zswap_drop(slot);
+
+  if (len < 0 || zswap_pool_sz + len > MM_ZSWAP)
+  {
+    zswap_rejected++;
+    pthread_mutex_unlock(&zswap_lock);
+    return -1;
+  }
+
+  if (zswap_tbl[typ] == NULL)
+    zswap_tbl[typ] = calloc(caller->mswp[typ]->maxfp, sizeof(struct zswap_entry *));
+
+  ent = malloc(sizeof(struct zswap_entry) + len);
+  ent->len = len;
+  memcpy(ent->data, cbuf, len);
+  zswap_tbl[typ][PAGING_SWPSLOT_OFF(slot)] = ent;
+
+  zswap_pool_sz += len;
+  zswap_stored++;
+  zswap_in_bytes += PAGING_PAGESZ;
+  zswap_out_bytes += len;
+  pthread_mutex_unlock(&zswap_lock);
+
+  return 0;
+}
+
+/*
+ *  zswap_load - get the page of @slot from the pool
+ *  Return 0 if it was there, the entry stays for a clean eviction.
+ */
+static int zswap_load(int slot, BYTE *page)
+{
+  struct zswap_entry **tbl;
+  int ret = -1;
+
+  pthread_mutex_lock(&zswap_lock);
+  tbl = zswap_tbl[PAGING_SWPSLOT_TYP(slot)];
+  if (tbl != NULL && tbl[PAGING_SWPSLOT_OFF(slot)] != NULL)
+  {
+    zswap_decompress(tbl[PAGING_SWPSLOT_OFF(slot)]->data,
+                     tbl[PAGING_SWPSLOT_OFF(slot)]->len, page);
+    zswap_loaded++;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&zswap_lock);
+
+  return ret;
+}
+#endif
+
+/*
+ *  set_swp_policy - choose how a swap device is picked for a page
+ *  @name: "rr", "least" or "stripe"
+ */
+int set_swp_policy(const char *name)
+{
+  int pit;
+
+  for (pit = 0; pit < (int)(sizeof(swp_names) / sizeof(swp_names[0])); pit++)
+    if (!strcmp(name, swp_names[pit]))
+    {
+      swp_policy = pit;
+      return 0;
+    }
+
+  return -1;
+}
+
+/* Configured devices, the first one is always there */
+static int swp_ndev(struct pcb_t *caller)
+{
+  int ndev = 0, sit;
+
+  for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+    if (caller->mswp[sit]->maxfp > 0)
+      ndev++;
+
+  return ndev > 0 ? ndev : 1;
+}
+
+/* Device the policy prefers for @pgn */
+static int swp_pick_dev(struct pcb_t *caller, int pgn)
+{
+  int sit, nth, best = 0;
+
+  switch (swp_policy)
+  {
+  case SWP_LEAST:
+    for (sit = 1; sit < PAGING_MAX_MMSWP; sit++)
+      if (caller->mswp[sit]->free_fp_cnt > caller->mswp[best]->free_fp_cnt)
+        best = sit;
+    return best;
+  case SWP_STRIPE:
+    nth = pgn % swp_ndev(caller);
+    break;
+  default:
+    nth = __sync_fetch_and_add(&swp_rr_next, 1) % swp_ndev(caller);
+  }
+
+  /* The nth configured device */
+  for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+    if (caller->mswp[sit]->maxfp > 0 && nth-- == 0)
+      return sit;
+
+  return 0;
+}
+
+/*
+ *  swp_get_slot - take a free swap frame for page @pgn
+ *  @caller: caller
+ *  @pgn:    page going off-line, the stripe unit
+ *  @slot:   return PAGING_SWPSLOT(device, frame)
+ */
+int swp_get_slot(struct pcb_t *caller, int pgn, int *slot)
+{
+  int first = swp_pick_dev(caller, pgn);
+  int sit, dev, fpn;
+
+  for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+  {
+    dev = (first + sit) % PAGING_MAX_MMSWP;
+    if (MEMPHY_get_freefp(caller->mswp[dev], &fpn) == 0)
+    {
+      MEMPHY_put_usedfp(caller->mswp[dev], fpn);
+      __sync_fetch_and_add(&swp_out_cnt[dev], 1);
+      *slot = PAGING_SWPSLOT(dev, fpn);
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ *  swp_write_page - push MEMRAM frame @fpn out to @slot
+ */
+int swp_write_page(struct pcb_t *caller, int fpn, int slot)
+{
+#ifdef MM_ZSWAP
+  BYTE page[PAGING_PAGESZ];
+
+  MEMPHY_get_frame(caller->mram, fpn, page);
+  if (zswap_store(caller, slot, page) == 0)
+    return 0;
+#endif
+
+  return __swap_cp_page(caller->mram, fpn, swp_dev(caller, slot), PAGING_SWPSLOT_OFF(slot));
+}
+
+/*
+ *  swp_read_page - bring @slot back into MEMRAM frame @fpn
+ */
+int swp_read_page(struct pcb_t *caller, int slot, int fpn)
+{
+#ifdef MM_ZSWAP
+  BYTE page[PAGING_PAGESZ];
+
+  if (zswap_load(slot, page) == 0)
+    return MEMPHY_set_frame(caller->mram, fpn, page);
+#endif
+
+  return __swap_cp_page(swp_dev(caller, slot), PAGING_SWPSLOT_OFF(slot), caller->mram, fpn);
+}
+
+/*
+ *  swp_cp_slot - duplicate the content of a swap slot
+ */
+int swp_cp_slot(struct pcb_t *caller, int srcslot, int dstslot)
+{
+#ifdef MM_ZSWAP
+  BYTE page[PAGING_PAGESZ];
+
+  if (zswap_load(srcslot, page) == 0)
+  {
+    if (zswap_store(caller, dstslot, page) == 0)
+      return 0;
+    return MEMPHY_set_frame(swp_dev(caller, dstslot), PAGING_SWPSLOT_OFF(dstslot), page);
+  }
+
+  pthread_mutex_lock(&zswap_lock);
+  zswap_drop(dstslot);
+  pthread_mutex_unlock(&zswap_lock);
+#endif
+
+  return __swap_cp_page(swp_dev(caller, srcslot), PAGING_SWPSLOT_OFF(srcslot),
+                        swp_dev(caller, dstslot), PAGING_SWPSLOT_OFF(dstslot));
+}
+
+/*
+ *  swp_put_slot - give a swap frame back to its device
+ */
+int swp_put_slot(struct pcb_t *caller, int slot)
+{
+#ifdef MM_ZSWAP
+  pthread_mutex_lock(&zswap_lock);
+  zswap_drop(slot);
+  pthread_mutex_unlock(&zswap_lock);
+#endif
+
+  return MEMPHY_put_freefp(swp_dev(caller, slot), PAGING_SWPSLOT_OFF(slot));
+}
+
+/*
+ *  swp_dev - device holding @slot
+ */
+struct memphy_struct *swp_dev(struct pcb_t *caller, int slot)
+{
+  return caller->mswp[PAGING_SWPSLOT_TYP(slot)];
+}
+
+/*
+ *  swp_writeback - copy the pages kept compressed to their slots
+ *  The pool keeps them too, a checkpoint then finds every swapped page
+ *  on its device.
+ */
+int swp_writeback(struct memphy_struct **mswp)
+{
+#ifdef MM_ZSWAP
+  BYTE page[PAGING_PAGESZ];
+  int sit, off;
+
+  pthread_mutex_lock(&zswap_lock);
+  for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+  {
+    if (zswap_tbl[sit] == NULL)
+      continue;
+    for (off = 0; off < mswp[sit]->maxfp; off++)
+      if (zswap_tbl[sit][off] != NULL)
+      {
+        zswap_decompress(zswap_tbl[sit][off]->data, zswap_tbl[sit][off]->len, page);
+        MEMPHY_set_frame(mswp[sit], off, page);
+      }
+  }
+  pthread_mutex_unlock(&zswap_lock);
+#endif
+
+  return 0;
+}
+
+/*
+ *  print_swp_stats - report how the slots spread over the devices
+ */
+void print_swp_stats(struct memphy_struct **mswp)
+{
+  int sit;
+
+  printf("Swap devices %s:", swp_names[swp_policy]);
+  for (sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+    if (mswp[sit]->maxfp > 0)
+    {
+      printf(" [%d] %lu slots %d/%d used", sit, swp_out_cnt[sit],
+             mswp[sit]->maxfp - mswp[sit]->free_fp_cnt, mswp[sit]->maxfp);
+      if (!mswp[sit]->rdmflg)
+        printf(" %lu bytes seeked", mswp[sit]->seek_bytes);
+    }
+  printf("\n");
+#ifdef MM_ZSWAP
+  printf("Compressed swap: %lu pages kept (ratio %.2f), %lu rejected, "
+         "%lu device accesses avoided\n",
+         zswap_stored, zswap_out_bytes ? (double)zswap_in_bytes / zswap_out_bytes : 0.0,
+         zswap_rejected, zswap_stored + zswap_loaded);
+#endif
+}
+
+// #endif
@@ -6,9 +6,46 @@
 
 #include "string.h"
 #include "mm.h"
+#include "loader.h"
+#include "sched.h"
+#include "timer.h"
 #include <stdlib.h>
 #include <stdio.h>
 
+/* Page replacement policy of this run and its fault count */
+static enum pgrepl_policy_t pgrepl_policy = PGREPL_FIFO;
+static unsigned long pgfault_cnt;
+static unsigned long pgwriteback_cnt;
+static unsigned long pgclean_cnt;
+static unsigned long pgrss_cnt;
+
+static int pg_find_victim(struct mm_struct *mm, int *retpgn, int retry);
+
+#ifdef MM_SWAP_READAHEAD
+/* Swap readahead window, widened by hits and narrowed by misses */
+static int rdahead_win = 1;
+static unsigned long rdahead_cnt;
+static unsigned long rdahead_hit;
+static unsigned long rdahead_miss;
+
+/*rdahead_resize - move the readahead window by @step within its bounds
+ *
+ *CPUs and kswapd resize it concurrently, under different mm locks.
+ */
+static void rdahead_resize(int step)
+{
+	int win;
+
+	do {
+		win = rdahead_win;
+		if (win + step < 1 || win + step > MM_SWAP_READAHEAD)
+			return;
+	} while (!__sync_bool_compare_and_swap(&rdahead_win, win, win + step));
+}
+#endif
+
+static const char *pgrepl_names[] = {"fifo", "sc", "clock", "lru"};
+
 /*enlist_vm_freerg_list - add new rg to freerg_list
  *@mm: memory region
  *@rg_elmt: new region
@@ -68,12 +105,11 @@ int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct *rg_elmt)
 		}
 		else if (flag_merge_up == 1 && flag_merge_down == 1)
 		{
-			new_node = malloc(sizeof(struct vm_rg_struct));
-			new_node->rg_end = node_need_dec_base->rg_end;
-			new_node->rg_start = node_need_inc_limit->rg_start;
-
+			/* The gap closes, the lower region grows over the upper one,
+			 * which leaves the list */
+			node_need_inc_limit->rg_end = node_need_dec_base->rg_end;
 			delete_vm_rg_node(&cur_vma->vm_freerg_list, node_need_dec_base);
-			delete_vm_rg_node(&cur_vma->vm_freerg_list, node_need_inc_limit);
+			return 1;
 		}
 	}
 	else
@@ -83,10 +119,9 @@ int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct *rg_elmt)
 		new_node->rg_end = rg_elmt->rg_end;
 	}
 
-	if (rg_node_head != NULL)
-		// rg_elmt->rg_next = rg_node_head;
-		// rg_elmt->rg_next = cur_vma->vm_freerg_list;
-		new_node->rg_next = rg_node_head;
+	// rg_elmt->rg_next = rg_node_head;
+	// rg_elmt->rg_next = cur_vma->vm_freerg_list;
+	new_node->rg_next = rg_node_head;
 
 	/* Enlist the new region */
 	// mm->mmap->vm_freerg_list = rg_elmt;
@@ -223,6 +258,7 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
 int __free(struct pcb_t *caller, int vmaid, int rgid)
 {
 	struct vm_rg_struct rgnode;
+	int pgn;
 
 	if (rgid < 0 || rgid > PAGING_MAX_SYMTBL_SZ)
 		return -1;
@@ -233,6 +269,14 @@ int __free(struct pcb_t *caller, int vmaid, int rgid)
 	// rgnode.rg_end = get_symrg_byid(caller->mm, rgid)->rg_end;
 	// rgnode.rg_start = get_symrg_byid(caller->mm, rgid)->rg_start;
 #endif
+	/* The region is gone, so are its cached translations */
+	for (pgn = PAGING_PGN(rgnode.rg_start); rgnode.rg_end > rgnode.rg_start &&
+		 pgn <= PAGING_PGN((rgnode.rg_end - 1)); pgn++)
+		tlb_flush_page(caller->pid, pgn);
+
+	/* A shared segment is only unmapped, its pages live on */
+	shm_detach(caller, rgnode.rg_start);
+
 	/*enlist the obsoleted memory region */
 	enlist_vm_freerg_list(caller->mm, &rgnode);
 	// enlist_vm_rg_node(caller->mm->mmap->vm_freerg_list,&rgnode);
@@ -257,6 +301,36 @@ int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
 	// reg_index = (uint32_t)addr;
 }
 
+/*pgfork - PAGING-based duplicate the process
+ *@proc: Process executing the instruction
+ *
+ *The child shares every on-line frame copy-on-write and is queued to run
+ *the rest of the same code.
+ */
+int pgfork(struct pcb_t *proc)
+{
+	struct pcb_t *child = clone_pcb(proc);
+
+	child->mm = malloc(sizeof(struct mm_struct));
+	if (copy_mm(child->mm, proc->mm, proc) != 0)
+	{
+		/* copy_mm gave back all it took */
+		free(child->mm);
+		free(child->page_table);
+		free(child);
+		return -1;
+	}
+	shm_fork(child->mm, proc->mm, child);
+
+	printf("\tForked process %d from process %d\n", child->pid, proc->pid);
+#ifdef MM_KSWAPD_LOW
+	kswapd_register(child);
+#endif
+	add_proc(child);
+
+	return 0;
+}
+
 /*pgfree - PAGING-based free a region memory
  *@proc: Process executing the instruction
  *@size: allocated size
@@ -268,6 +342,361 @@ int pgfree_data(struct pcb_t *proc, uint32_t reg_index)
 	return __free(proc, 0, reg_index);
 }
 
+/*pg_swap_out - move an on-line page of @mm to swap
+ *@mm: memory region
+ *@vicpgn: the page
+ *@caller: caller
+ *
+ *Its frame loses one mapping. A frame still shared copy-on-write stays
+ *with the other sharers, a private one is the caller's to reuse.
+ */
+static int pg_swap_out(struct mm_struct *mm, int vicpgn, struct pcb_t *caller)
+{
+	uint32_t vicpte;
+	int vicfpn, swpslot, ref;
+
+#ifdef MM_HUGEPAGE
+	/* Only base pages go to swap, split a huge victim first */
+	pg_split_huge(mm, vicpgn);
+#endif
+	vicpte = mm->pgd[vicpgn];
+	vicfpn = PAGING_FPN(vicpte);
+
+#ifdef MM_SWAP_READAHEAD
+	/* Read ahead for nothing */
+	if (vicpte & PAGING_PTE_RDAHEAD_MASK)
+	{
+		__sync_fetch_and_add(&rdahead_miss, 1);
+		rdahead_resize(-1);
+	}
+#endif
+
+	/* A clean victim still matches the swap slot it came from,
+	 * only a dirty or never swapped one is copied out */
+	swpslot = mm->swp_slot[vicpgn];
+	if (swpslot >= 0 && !(vicpte & PAGING_PTE_DIRTY_MASK))
+		__sync_fetch_and_add(&pgclean_cnt, 1);
+	else
+	{
+		/* Get free frame in MEMSWP, unless it has one to overwrite */
+		if (swpslot < 0 && swp_get_slot(caller, vicpgn, &swpslot) != 0)
+			return -1;
+
+		/* Copy victim frame to swap */
+		swp_write_page(caller, vicfpn, swpslot);
+		__sync_fetch_and_add(&pgwriteback_cnt, 1);
+	}
+
+	/* Update page table */
+	pte_set_swap(&mm->pgd[vicpgn], PAGING_SWPSLOT_TYP(swpslot),
+				 PAGING_SWPSLOT_OFF(swpslot));
+	mm->swp_slot[vicpgn] = -1;
+	remove_pgn_node(&mm->fifo_pgn, vicpgn);
+	tlb_flush_page(caller->pid, vicpgn);
+
+	/* The last sharer of a copy-on-write frame now owns it alone */
+	ref = MEMPHY_unref_frame(caller->mram, vicfpn);
+#ifdef MM_KSM
+	ksm_unshare(vicfpn, ref);
+#endif
+
+	return 0;
+}
+
+/*pg_evict_page - push a victim page out of MEMRAM to free its frame
+ *@mm: memory region
+ *@retfpn: return the freed FPN
+ *@caller: caller
+ *
+ */
+int pg_evict_page(struct mm_struct *mm, int *retfpn, struct pcb_t *caller)
+{
+	int vicpgn, vicfpn, found, shmret = 1, retry = 0;
+	int *skipped = NULL, nskipped = 0;
+
+	/* Find victim page. One another process still maps copy-on-write
+	 * leaves this mapping for swap, the frame stays with the others and
+	 * the search goes on. A shared page leaves MEMRAM for all its mappers
+	 * at once, unless one of them is busy and it is set aside */
+	while ((found = pg_find_victim(mm, &vicpgn, retry++)) != 0)
+	{
+		vicfpn = PAGING_FPN(mm->pgd[vicpgn]);
+		if (MEMPHY_get_refcnt(caller->mram, vicfpn) > 1)
+		{
+			if (pg_swap_out(mm, vicpgn, caller) != 0)
+			{
+				found = 0;
+				break;
+			}
+			continue;
+		}
+
+		if ((shmret = shm_evict_page(caller, vicpgn, vicfpn)) != 2)
+			break;
+
+		if (skipped == NULL)
+			skipped = malloc(mm->fifo_pgn.count * sizeof(int));
+		remove_pgn_node(&mm->fifo_pgn, vicpgn);
+		skipped[nskipped++] = vicpgn;
+	}
+
+	while (nskipped > 0)
+		enlist_pgn_node(&mm->fifo_pgn, skipped[--nskipped]);
+	free(skipped);
+
+	if (!found)
+		return -1;
+
+	switch (shmret)
+	{
+	case 0:
+		__sync_fetch_and_add(&pgwriteback_cnt, 1);
+		*retfpn = vicfpn;
+		return 0;
+	case -1:
+		return -1;
+	}
+
+	if (pg_swap_out(mm, vicpgn, caller) != 0)
+		return -1;
+
+	*retfpn = vicfpn;
+	return 0;
+}
+
+/*pg_alloc_frame - get a MEMRAM frame for a new on-line page
+ *@mm: memory region
+ *@retfpn: return the FPN
+ *@caller: caller
+ *
+ *A process at its resident set limit replaces one of its own pages even
+ *with frames free, others take a free frame before evicting. When only
+ *pages it still shares copy-on-write are left, they all go to swap and
+ *the set grows past it.
+ */
+int pg_alloc_frame(struct mm_struct *mm, int *retfpn, struct pcb_t *caller)
+{
+	if (mm->rss_limit > 0 && PAGING_RSS(mm) >= mm->rss_limit &&
+		pg_evict_page(mm, retfpn, caller) == 0)
+	{
+		__sync_fetch_and_add(&pgrss_cnt, 1);
+		return 0;
+	}
+
+	if (MEMPHY_get_freefp(caller->mram, retfpn) == 0)
+	{
+		MEMPHY_put_usedfp(caller->mram, *retfpn);
+		return 0;
+	}
+
+	/* RAM is full, reclaim the frame of a victim */
+	return pg_evict_page(mm, retfpn, caller);
+}
+
+/*pg_cow_break - give a written copy-on-write page its private frame
+ *@mm: memory region
+ *@pgn: PGN
+ *@fpn: return the FPN to write to
+ *@caller: caller
+ *
+ */
+static int pg_cow_break(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
+{
+	int oldfpn = PAGING_FPN(mm->pgd[pgn]);
+	int newfpn, ref;
+
+	/* The last sharer simply takes the frame back */
+	if (MEMPHY_get_refcnt(caller->mram, oldfpn) <= 1)
+	{
+		ref = MEMPHY_unref_frame(caller->mram, oldfpn);
+#ifdef MM_KSM
+		ksm_unshare(oldfpn, ref);
+#endif
+		CLRBIT(mm->pgd[pgn], PAGING_PTE_COW_MASK);
+		*fpn = oldfpn;
+		return 0;
+	}
+
+	/* The page itself must not be picked to make room for its copy */
+	remove_pgn_node(&mm->fifo_pgn, pgn);
+
+	if (pg_alloc_frame(mm, &newfpn, caller) != 0)
+	{
+		enlist_pgn_node(&mm->fifo_pgn, pgn);
+		return -1;
+	}
+
+	MEMPHY_cp_frame(caller->mram, oldfpn, caller->mram, newfpn);
+	ref = MEMPHY_unref_frame(caller->mram, oldfpn);
+#ifdef MM_KSM
+	ksm_unshare(oldfpn, ref);
+#endif
+
+	pte_set_fpn(&mm->pgd[pgn], newfpn);
+	enlist_pgn_node(&mm->fifo_pgn, pgn);
+	tlb_flush_page(caller->pid, pgn);
+
+	*fpn = newfpn;
+	return 0;
+}
+
+#ifdef MM_HUGEPAGE
+/*pg_demand_huge - back a block with a whole huge page once it is used
+ *@mm: memory region
+ *@pgn: PGN, never touched
+ *@caller: caller
+ *
+ *Only when the aligned huge block lies inside the area, MM_HUGEPAGE of
+ *its pages are touched with this one, and all of those are private and
+ *on-line. Their content moves to the huge page, the rest is zeroed.
+ */
+static int pg_demand_huge(struct mm_struct *mm, int pgn, struct pcb_t *caller)
+{
+	struct vm_area_struct *cur_vma = get_vma_by_num(mm, 0);
+	int hpgn = PAGING_HUGE_PGN(pgn);
+	int pgit, fpn, ntouched = 1;
+	uint32_t pte;
+
+	if ((hpgn + PAGING_HUGE_NPAGES) * PAGING_PAGESZ > cur_vma->vm_end)
+		return -1;
+
+	for (pgit = hpgn; pgit < hpgn + PAGING_HUGE_NPAGES; pgit++)
+	{
+		pte = mm->pgd[pgit];
+		if (shm_find(mm, pgit))
+			return -1;
+		if (pte == 0)
+			continue;
+		if (!PAGING_PAGE_PRESENT(pte) || PAGING_PAGE_COW(pte) ||
+			MEMPHY_get_refcnt(caller->mram, PAGING_FPN(pte)) > 1)
+			return -1;
+		ntouched++;
+	}
+	if (ntouched < MM_HUGEPAGE)
+		return -1;
+
+	/* The block grows the resident set like the base pages it lacks */
+	if (mm->rss_limit > 0 &&
+		PAGING_RSS(mm) + PAGING_HUGE_NPAGES - ntouched + 1 > mm->rss_limit)
+		return -1;
+#ifdef MM_KSWAPD_LOW
+	/* and must not push RAM under the reclaim watermark */
+	if (caller->mram->free_fp_cnt - (PAGING_HUGE_NPAGES - ntouched + 1) <
+		caller->mram->maxfp * MM_KSWAPD_LOW / 100)
+		return -1;
+#endif
+
+	if (MEMPHY_try_freefp_order(caller->mram, PAGING_HUGE_ORDER, &fpn) != 0)
+		return -1;
+
+	for (pgit = 0; pgit < PAGING_HUGE_NPAGES; pgit++)
+	{
+		pte = mm->pgd[hpgn + pgit];
+		MEMPHY_put_usedfp(caller->mram, fpn + pgit);
+		if (pte == 0)
+		{
+			MEMPHY_zero_frame(caller->mram, fpn + pgit);
+			continue;
+		}
+
+		MEMPHY_cp_frame(caller->mram, PAGING_FPN(pte), caller->mram, fpn + pgit);
+		MEMPHY_put_freefp(caller->mram, PAGING_FPN(pte));
+		remove_pgn_node(&mm->fifo_pgn, hpgn + pgit);
+		tlb_flush_page(caller->pid, hpgn + pgit);
+		mm->pgd[hpgn + pgit] = 0;
+
+		/* A huge page has no slot, the split pages are written out */
+		if (mm->swp_slot[hpgn + pgit] >= 0)
+		{
+			swp_put_slot(caller, mm->swp_slot[hpgn + pgit]);
+			mm->swp_slot[hpgn + pgit] = -1;
+		}
+	}
+
+	pte_set_huge(&mm->pgd[hpgn], fpn);
+	enlist_pgn_node(&mm->fifo_pgn, hpgn);
+	mm->nhuge++;
+
+	return 0;
+}
+#endif
+
+/*pg_demand_page - give a never touched page its zero-filled frame
+ *@mm: memory region
+ *@pgn: PGN
+ *@caller: caller
+ *
+ */
+static int pg_demand_page(struct mm_struct *mm, int pgn, struct pcb_t *caller)
+{
+	struct vm_area_struct *cur_vma = get_vma_by_num(mm, 0);
+	int fpn;
+
+	/* Only reserved heap pages can be faulted in */
+	if (cur_vma == NULL || pgn * PAGING_PAGESZ >= cur_vma->vm_end)
+		return -1;
+
+	__sync_fetch_and_add(&pgfault_cnt, 1);
+
+#ifdef MM_HUGEPAGE
+	if (pg_demand_huge(mm, pgn, caller) == 0)
+		return 0;
+#endif
+
+	if (pg_alloc_frame(mm, &fpn, caller) != 0)
+		return -1;
+
+	MEMPHY_zero_frame(caller->mram, fpn);
+
+	pte_set_fpn(&mm->pgd[pgn], fpn);
+	enlist_pgn_node(&mm->fifo_pgn, pgn);
+
+	return 0;
+}
+
+#ifdef MM_SWAP_READAHEAD
+/*pg_readahead - bring the swapped pages following a fault on-line
+ *@mm: memory region
+ *@pgn: PGN just swapped in
+ *@caller: caller
+ *
+ *Stops at the first page not in swap. A frame it cannot get free is
+ *reclaimed like for the fault itself, the window keeps that in check.
+ *The faulted page is not listed yet, so it is never the victim.
+ */
+static void pg_readahead(struct mm_struct *mm, int pgn, struct pcb_t *caller)
+{
+	int pgit, fpn, swpslot;
+	int win = rdahead_win;
+	uint32_t pte;
+
+	for (pgit = pgn + 1; pgit <= pgn + win && pgit < PAGING_MAX_PGN; pgit++)
+	{
+		pte = mm->pgd[pgit];
+		if (PAGING_PAGE_PRESENT(pte) || !(pte & PAGING_PTE_SWAPPED_MASK) ||
+			shm_find(mm, pgit))
+			break;
+
+		/* Never push out pages of a limited set to guess, the faulted
+		 * page still has to be counted in it */
+		if (mm->rss_limit > 0 && PAGING_RSS(mm) + 1 >= mm->rss_limit)
+			break;
+
+		if (pg_alloc_frame(mm, &fpn, caller) != 0)
+			break;
+
+		swpslot = PAGING_PTE_SWPSLOT(pte);
+		swp_read_page(caller, swpslot, fpn);
+
+		pte_set_fpn(&mm->pgd[pgit], fpn);
+		SETBIT(mm->pgd[pgit], PAGING_PTE_RDAHEAD_MASK);
+		mm->swp_slot[pgit] = swpslot;
+		enlist_pgn_node(&mm->fifo_pgn, pgit);
+		__sync_fetch_and_add(&rdahead_cnt, 1);
+	}
+}
+#endif
+
 /*pg_getpage - get the page in ram
  *@mm: memory region
  *@pagenum: PGN
@@ -280,46 +709,97 @@ int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
 {
 	uint32_t pte = mm->pgd[pgn];
 
+#ifdef MM_HUGEPAGE
+	/* Tail pages of an on-line huge page resolve through its head PTE */
+	uint32_t hpte = mm->pgd[PAGING_HUGE_PGN(pgn)];
+	if (PAGING_PAGE_PRESENT(hpte) && PAGING_PAGE_HUGE(hpte))
+	{
+		*fpn = PAGING_FPN(hpte) + (pgn - PAGING_HUGE_PGN(pgn));
+		return 0;
+	}
+#endif
+
+	if (!PAGING_PAGE_PRESENT(pte))
+	{ /* Pages of a shared segment are found through the segment */
+		switch (shm_fault(mm, pgn, caller))
+		{
+		case 0:
+			__sync_fetch_and_add(&pgfault_cnt, 1);
+			*fpn = PAGING_FPN(mm->pgd[pgn]);
+			return 0;
+		case -1:
+			return -1;
+		}
+	}
+
+	if (!PAGING_PAGE_PRESENT(pte) && !(pte & PAGING_PTE_SWAPPED_MASK))
+	{ /* Page was reserved but never touched */
+		if (pg_demand_page(mm, pgn, caller) != 0)
+			return -1;
+
+		return pg_getpage(mm, pgn, fpn, caller);
+	}
+
 	if (!PAGING_PAGE_PRESENT(pte))
 	{ /* Page is not online, make it actively living */
-		int vicpgn, swpfpn;
-		// int vicfpn;
-		// uint32_t vicpte;
+		int vicfpn;
+
+		__sync_fetch_and_add(&pgfault_cnt, 1);
 
-		int tgtfpn = PAGING_SWP(pte); // the target frame storing our variable
+		int tgtslot = PAGING_PTE_SWPSLOT(pte); // the target frame storing our variable
 
 		/* TODO: Play with your paging theory here */
-		/* Find victim page */
-		if (find_victim_page(caller, caller->mm, &vicpgn) == 0)
+		if (pg_alloc_frame(mm, &vicfpn, caller) != 0)
 			return -1;
-		// get vicpgn
-		uint32_t vicpte = mm->pgd[vicpgn];
-		int vicfpn = PAGING_FPN(vicpte);
 
-		/* Get free frame in MEMSWP */
-		MEMPHY_get_freefp(caller->active_mswp, &swpfpn);
-
-		/* Do swap frame from MEMRAM to MEMSWP and vice versa*/
-		/* Copy victim frame to swap */
-		__swap_cp_page(caller->mram, vicfpn, caller->active_mswp, swpfpn);
 		/* Copy target frame from swap to mem */
-		__swap_cp_page(caller->active_mswp, tgtfpn, caller->mram, vicfpn);
-
-		/* Update page table */
-		pte_set_swap(&mm->pgd[vicpgn], 0, swpfpn);
+		swp_read_page(caller, tgtslot, vicfpn);
 
-		/* Update its online status of the target page */
+		/* Update its online status of the target page, it stays
+		 * associated with its swap slot until it is written */
 		// pte_set_fpn(&pte, tgtfpn);
 		pte_set_fpn(&mm->pgd[pgn], vicfpn);
+		mm->swp_slot[pgn] = tgtslot;
 
+#ifdef MM_SWAP_READAHEAD
+		/* Listed last so reclaim for the readahead cannot pick it */
+		pg_readahead(mm, pgn, caller);
+#endif
 		enlist_pgn_node(&caller->mm->fifo_pgn, pgn);
 	}
 
-	*fpn = PAGING_FPN(pte);
+	*fpn = PAGING_FPN(mm->pgd[pgn]);
 
 	return 0;
 }
 
+/*pg_mark_pte - set access tracking bits of an on-line page
+ *@mm: memory region
+ *@pgn: PGN, a tail page of a huge page marks its head PTE
+ *@mask: PAGING_PTE_ACCESSED_MASK and/or PAGING_PTE_DIRTY_MASK
+ *
+ */
+static void pg_mark_pte(struct mm_struct *mm, int pgn, uint32_t mask)
+{
+#ifdef MM_HUGEPAGE
+	if (PAGING_PAGE_HUGE(mm->pgd[PAGING_HUGE_PGN(pgn)]))
+		pgn = PAGING_HUGE_PGN(pgn);
+#endif
+#ifdef MM_SWAP_READAHEAD
+	/* First use of a page read ahead, the window was worth it */
+	if (mm->pgd[pgn] & PAGING_PTE_RDAHEAD_MASK)
+	{
+		CLRBIT(mm->pgd[pgn], PAGING_PTE_RDAHEAD_MASK);
+		__sync_fetch_and_add(&rdahead_hit, 1);
+		rdahead_resize(1);
+	}
+#endif
+#ifdef MM_WSS_WINDOW
+	mm->pg_atime[pgn] = current_time() + 1;
+#endif
+	SETBIT(mm->pgd[pgn], mask);
+}
+
 /*pg_getval - read value at given offset
  *@mm: memory region
  *@addr: virtual address to acess
@@ -333,8 +813,18 @@ int pg_getval(struct mm_struct *mm, int addr, BYTE *data, struct pcb_t *caller)
 	int fpn;
 
 	/* Get the page to MEMRAM, swap from MEMSWAP if needed */
-	if (pg_getpage(mm, pgn, &fpn, caller) != 0)
-		return -1; /* invalid page access */
+	if (tlb_lookup(caller, pgn, &fpn) != 0)
+	{
+		if (pg_getpage(mm, pgn, &fpn, caller) != 0)
+			return -1; /* invalid page access */
+
+		tlb_update(caller, pgn, fpn);
+	}
+
+#ifdef MM_NUMA_REMOTE_COST
+	fpn = numa_access(caller, pgn, fpn);
+#endif
+	pg_mark_pte(mm, pgn, PAGING_PTE_ACCESSED_MASK);
 
 	int phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
 
@@ -356,8 +846,27 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller)
 	int fpn;
 
 	/* Get the page to MEMRAM, swap from MEMSWAP if needed */
-	if (pg_getpage(mm, pgn, &fpn, caller) != 0)
-		return -1; /* invalid page access */
+	if (tlb_lookup(caller, pgn, &fpn) != 0)
+	{
+		if (pg_getpage(mm, pgn, &fpn, caller) != 0)
+			return -1; /* invalid page access */
+
+		tlb_update(caller, pgn, fpn);
+	}
+
+	/* First write to a page shared since FORK */
+	if (PAGING_PAGE_COW(mm->pgd[pgn]))
+	{
+		if (pg_cow_break(mm, pgn, &fpn, caller) != 0)
+			return -1;
+
+		tlb_update(caller, pgn, fpn);
+	}
+
+#ifdef MM_NUMA_REMOTE_COST
+	fpn = numa_access(caller, pgn, fpn);
+#endif
+	pg_mark_pte(mm, pgn, PAGING_PTE_ACCESSED_MASK | PAGING_PTE_DIRTY_MASK);
 
 	int phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
 
@@ -494,8 +1003,7 @@ int free_pcb_memph(struct pcb_t *caller)
 		}
 		else
 		{
-			fpn = PAGING_SWP(pte);
-			MEMPHY_put_freefp(caller->active_mswp, fpn);
+			swp_put_slot(caller, PAGING_PTE_SWPSLOT(pte));
 		}
 	}
 
@@ -579,9 +1087,15 @@ int inc_vma_limit(struct pcb_t *caller, int vmaid, int origin_size)
 	// if (vm_map_ram(caller, area->rg_start, area->rg_end,
 	// 			   old_end, incnumpage, newrg) < 0)
 	// 	return -1; /* Map the memory to MEMRAM */
+#ifndef MM_DEMAND_PAGING
 	if (vm_map_ram(caller, area->rg_start, area->rg_end,
 				   old_end, incnumpage, area) < 0)
 		return -1; /* Map the memory to MEMRAM */
+#else
+	/* Only virtual space is reserved, frames come on first touch */
+	(void)old_end;
+	(void)incnumpage;
+#endif
 
 	free(area);
 	return 0;
@@ -597,73 +1111,221 @@ void find_min(int* arr, int size, int* ret_elmnt) {
 	}
 }
 
-/*find_victim_page - find victim page
- *@caller: caller
- *@retpgn: return page number
- *return : retpgn and function's value(0 if failed, otherwise 1)
+/*set_pgrepl_policy - select the page replacement policy of this run
+ *@name: one of fifo, sc, clock, lru
+ *return : 0 if success, -1 if the name is unknown
  */
+int set_pgrepl_policy(const char *name)
+{
+	int pit;
 
-int find_victim_page(struct pcb_t *caller, struct mm_struct *mm, int *retpgn)
+	for (pit = PGREPL_FIFO; pit <= PGREPL_LRU; pit++)
+	{
+		if (!strcmp(name, pgrepl_names[pit]))
+		{
+			pgrepl_policy = pit;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*print_pgrepl_stats - report the page faults taken under the policy
+ */
+void print_pgrepl_stats(void)
 {
-	struct pgn_t *pg = mm->fifo_pgn;
-/* 	int end_pgn = PAGING_PGN(get_vma_by_num(mm,0)->vm_end);
-	int start_pgn = PAGING_PGN(get_vma_by_num(mm,0)->vm_start);
+	printf("Page replacement %s: %lu page faults\n",
+		   pgrepl_names[pgrepl_policy], pgfault_cnt);
+	printf("Swap out: %lu writebacks, %lu clean evictions skipped the copy\n",
+		   pgwriteback_cnt, pgclean_cnt);
+	printf("Resident set limits: %lu pages replaced within their process\n",
+		   pgrss_cnt);
+#ifdef MM_SWAP_READAHEAD
+	printf("Swap readahead: %lu pages, %lu hits, %lu misses, window %d\n",
+		   rdahead_cnt, rdahead_hit, rdahead_miss, rdahead_win);
+#endif
+}
 
-	int size_pgtbl = end_pgn - start_pgn;
+#ifdef MM_WSS_WINDOW
+/*print_wss - sample the working set of a process
+ *@proc: process
+ *
+ *Pages used during the last MM_WSS_WINDOW time slots, on-line or not,
+ *next to the pages it holds in MEMRAM.
+ */
+void print_wss(struct pcb_t *proc)
+{
+	struct mm_struct *mm = proc->mm;
+	struct vm_area_struct *cur_vma = get_vma_by_num(mm, 0);
+	uint64_t now = current_time();
+	int pgn, npg, wss = 0;
 
-	int *count = malloc((size_pgtbl)*sizeof(int));
+	for (pgn = 0; cur_vma != NULL && pgn < PAGING_PGN(cur_vma->vm_end); pgn += npg)
+	{
+		npg = 1;
+#ifdef MM_HUGEPAGE
+		if (PAGING_PAGE_PRESENT(mm->pgd[pgn]) && PAGING_PAGE_HUGE(mm->pgd[pgn]))
+			npg = PAGING_HUGE_NPAGES;
+#endif
+		if (mm->pg_atime[pgn] != 0 && mm->pg_atime[pgn] + MM_WSS_WINDOW > now)
+			wss += npg;
+	}
+
+	if (wss > mm->wss_peak)
+		mm->wss_peak = wss;
+
+	printf("\tWorking set of process %2d at time %lu: %d pages (peak %d), %d resident",
+		   proc->pid, (unsigned long)now, wss, mm->wss_peak, PAGING_RSS(mm));
+	if (mm->rss_limit > 0)
+		printf(" of %d", mm->rss_limit);
+	printf("\n");
+}
+#endif
 
-	for (int k = 0; k < size_pgtbl; ++k) {
-		count[k] = 0;
+/*find_victim_fifo - oldest on-line page
+ */
+static int find_victim_fifo(struct mm_struct *mm, struct pgn_list *pl, int *retpgn)
+{
+	int pgn;
+
+	while ((pgn = pl->head) != -1)
+	{
+		if (PAGING_PAGE_PRESENT(mm->pgd[pgn]))
+		{
+			*retpgn = pgn;
+			return 1;
+		}
+		remove_pgn_node(pl, pgn);
 	}
+
+	return 0;
+}
+
+/*find_victim_sc - second chance, a referenced page is moved to the tail
  */
+static int find_victim_sc(struct mm_struct *mm, struct pgn_list *pl, int *retpgn)
+{
+	int pgn;
 
-	
-	// uint32_t pte;
-	// *retpgn = -1;
-	// while (pg != NULL)
-	// {
-	// 	pte = mm->pgd[pg->pgn];
-	// 	if (!PAGING_PAGE_PRESENT(pte))
-	// 	{
-	// 		*retpgn = PAGING_FPN(mm->pgd[pg->pgn]);
-	// 		// free(pg);
-	// 		return 1;
-	// 	}
-	// 	pg = pg->pg_next;
-	// }
+	while ((pgn = pl->head) != -1)
+	{
+		if (!PAGING_PAGE_PRESENT(mm->pgd[pgn]))
+			remove_pgn_node(pl, pgn);
+		else if (PAGING_PAGE_ACCESSED(mm->pgd[pgn]))
+		{
+			CLRBIT(mm->pgd[pgn], PAGING_PTE_ACCESSED_MASK);
+			touch_pgn_node(pl, pgn);
+		}
+		else
+		{
+			*retpgn = pgn;
+			return 1;
+		}
+	}
 
-	// /* TODO: Implement the theorical mechanism to find the victim page */
+	return 0;
+}
 
-	// // free(pg);
-/* 
-	if (pg == NULL)
-		return 0;
-	while ()
+/*find_victim_clock - second chance with a circulating hand
+ */
+static int find_victim_clock(struct mm_struct *mm, struct pgn_list *pl, int *retpgn)
+{
+	int pgn;
+
+	if (pl->hand == -1)
+		pl->hand = pl->head;
+
+	while ((pgn = pl->hand) != -1)
 	{
-		while (pg != NULL && pg->pg_next != NULL)
+		if (!PAGING_PAGE_PRESENT(mm->pgd[pgn]))
 		{
-			pg = pg->pg_next;
+			remove_pgn_node(pl, pgn); /* moves the hand on */
+			continue;
+		}
+
+		pl->hand = (pl->pg_next[pgn] != -1) ? pl->pg_next[pgn] : pl->head;
+
+		if (PAGING_PAGE_ACCESSED(mm->pgd[pgn]))
+			CLRBIT(mm->pgd[pgn], PAGING_PTE_ACCESSED_MASK);
+		else
+		{
+			*retpgn = pgn;
+			return 1;
 		}
 	}
- */	
-	if (pg == NULL) return 0;
-	int flag_found = 0;
-	while (pg != NULL) {
-		if (!PAGING_PAGE_PRESENT(mm->pgd[pg->pgn])) pg = pg->pg_next;
-		else {
-			flag_found = 1;
-			break;
+
+	return 0;
+}
+
+/*find_victim_lru - age every on-line page, evict the least recently used
+ *@age: 0 when retrying the same search, the pages were aged already
+ */
+static int find_victim_lru(struct mm_struct *mm, struct pgn_list *pl, int *retpgn, int age)
+{
+	int pgn, next;
+	int vicpgn = -1;
+
+	for (pgn = pl->head; pgn != -1; pgn = next)
+	{
+		next = pl->pg_next[pgn];
+
+		if (!PAGING_PAGE_PRESENT(mm->pgd[pgn]))
+		{
+			remove_pgn_node(pl, pgn);
+			continue;
+		}
+
+		/* Shift in the referenced bit as the new most significant one */
+		if (age)
+			pl->pg_age[pgn] >>= 1;
+		if (age && PAGING_PAGE_ACCESSED(mm->pgd[pgn]))
+		{
+			pl->pg_age[pgn] |= 0x80;
+			CLRBIT(mm->pgd[pgn], PAGING_PTE_ACCESSED_MASK);
 		}
+
+		/* Ties go to the oldest page */
+		if (vicpgn == -1 || pl->pg_age[pgn] < pl->pg_age[vicpgn])
+			vicpgn = pgn;
 	}
-	if (!flag_found) return 0;
 
-	*retpgn = pg->pgn;
-	// mm->fifo_pgn = pg->pg_next;
-	// free(pg);
-	// pg = NULL;
+	if (vicpgn == -1)
+		return 0;
+
+	*retpgn = vicpgn;
 	return 1;
-	// return 0;
+}
+
+/*find_victim_page - find victim page
+ *@caller: caller
+ *@retpgn: return page number
+ *return : retpgn and function's value(0 if failed, otherwise 1)
+ */
+
+int find_victim_page(struct pcb_t *caller, struct mm_struct *mm, int *retpgn)
+{
+	return pg_find_victim(mm, retpgn, 0);
+}
+
+/*pg_find_victim - find victim page of @mm
+ *@retry: the number of victims this search already passed over
+ */
+static int pg_find_victim(struct mm_struct *mm, int *retpgn, int retry)
+{
+	struct pgn_list *pl = &mm->fifo_pgn;
+
+	switch (pgrepl_policy)
+	{
+	case PGREPL_SC:
+		return find_victim_sc(mm, pl, retpgn);
+	case PGREPL_CLOCK:
+		return find_victim_clock(mm, pl, retpgn);
+	case PGREPL_LRU:
+		return find_victim_lru(mm, pl, retpgn, retry == 0);
+	default:
+		return find_victim_fifo(mm, pl, retpgn);
+	}
 }
 
 /*get_free_vmrg_area - get a free vm region
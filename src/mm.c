@@ -5,8 +5,12 @@
  */
 
 #include "mm.h"
+#include "checkpoint.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
 
 
 
@@ -60,6 +64,7 @@ int pte_set_swap(uint32_t *pte, int swptyp, int swpoff)
 {
   CLRBIT(*pte, PAGING_PTE_PRESENT_MASK);
   SETBIT(*pte, PAGING_PTE_SWAPPED_MASK);
+  CLRBIT(*pte, PAGING_PTE_DIRTY_MASK);
 
   SETVAL(*pte, swptyp, PAGING_PTE_SWPTYP_MASK, PAGING_PTE_SWPTYP_LOBIT);
   SETVAL(*pte, swpoff, PAGING_PTE_SWPOFF_MASK, PAGING_PTE_SWPOFF_LOBIT);
@@ -71,55 +76,90 @@ int pte_set_swap(uint32_t *pte, int swptyp, int swpoff)
  * pte_set_fpn - Set PTE entry for on-line page
  * @pte   : target page table entry (PTE)
  * @fpn   : frame page number (FPN)
+ *
+ * The entry is rebuilt from scratch. A page coming back from swap must
+ * not keep the ACCESSED, DIRTY, COW or RDAHEAD bits, nor the swap offset,
+ * of its former life.
  */
 int pte_set_fpn(uint32_t *pte, int fpn)
 {
+  *pte = 0;
   SETBIT(*pte, PAGING_PTE_PRESENT_MASK);
-  CLRBIT(*pte, PAGING_PTE_SWAPPED_MASK);
 
   SETVAL(*pte, fpn, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT);
 
   return 0;
 }
 
+/*
+ * pte_set_huge - Set head PTE entry for an on-line huge page
+ * @pte   : target page table entry (PTE)
+ * @fpn   : first frame of the PAGING_HUGE_NPAGES frames block
+ */
+int pte_set_huge(uint32_t *pte, int fpn)
+{
+  pte_set_fpn(pte, fpn);
+  SETBIT(*pte, PAGING_PTE_HUGE_MASK);
+
+  return 0;
+}
+
+/*
+ * pg_split_huge - break a huge page back into PAGING_HUGE_NPAGES PTEs
+ * @mm    : self mm
+ * @pgn   : head page number of the huge page
+ *
+ * The swap path only moves base pages, a huge victim is split first and
+ * its tail pages join the replacement list like any other page.
+ */
+int pg_split_huge(struct mm_struct *mm, int pgn)
+{
+  uint32_t pte = mm->pgd[pgn];
+  int fpn = PAGING_FPN(pte);
+  int pgit;
+
+  if (!PAGING_PAGE_PRESENT(pte) || !PAGING_PAGE_HUGE(pte))
+    return -1;
+
+  CLRBIT(mm->pgd[pgn], PAGING_PTE_HUGE_MASK);
+  mm->nhuge--;
+  for (pgit = 1; pgit < PAGING_HUGE_NPAGES; pgit++)
+  {
+    pte_set_fpn(&mm->pgd[pgn + pgit], fpn + pgit);
+    enlist_pgn_node(&mm->fifo_pgn, pgn + pgit);
+  }
+
+  return 0;
+}
+
 /*
  * vmap_page_range - map a range of page at aligned address
  */
 int vmap_page_range(struct pcb_t *caller,           // process call
                     int addr,                       // start address which is aligned to pagesz
                     int pgnum,                      // num of mapping page
-                    struct framephy_struct *frames, // list of the mapped frames
-                    struct vm_rg_struct *ret_rg,
-                    struct framephy_struct *frm_lst_swap)    // return mapped region, the real mapped fp
+                    int *frames,                    // the mapped frames, then swap slots
+                    int nram,                       // number of frames in ram
+                    struct vm_rg_struct *ret_rg)    // return mapped region, the real mapped fp
 {                                                   // no guarantee all given pages are mapped
-  struct framephy_struct *fpit = frames, *fpit_swp = frm_lst_swap;
-  int pgit = 0;
+  int pgit;
   int pgn = PAGING_PGN(addr);
 
   /* MY code */
 
-  while (fpit != NULL) {
-    pte_set_fpn(&caller->mm->pgd[pgn + pgit],fpit->fpn);
-    frames = frames->fp_next;
-    free(fpit);
-    fpit = frames;
-    pgit++;
+  for (pgit = 0; pgit < nram; pgit++) {
+    pte_set_fpn(&caller->mm->pgd[pgn + pgit], frames[pgit]);
 
     // Tracking for later page replacement activities (if needed)
     // Enqueue new usage page 
     enlist_pgn_node(&caller->mm->fifo_pgn, pgn + pgit);
   }
 
-  while (fpit_swp != NULL) {
-    pte_set_swap(&caller->mm->pgd[pgn + pgit],0,fpit_swp->fpn);
-    frm_lst_swap = frm_lst_swap->fp_next;
-    free(fpit_swp);
-    fpit_swp = frm_lst_swap;
-    pgit++;
+  for (; pgit < pgnum; pgit++) {
+    pte_set_swap(&caller->mm->pgd[pgn + pgit],
+                 PAGING_SWPSLOT_TYP(frames[pgit]), PAGING_SWPSLOT_OFF(frames[pgit]));
 
-    // Tracking for later page replacement activities (if needed)
-    // Enqueue new usage page 
-    enlist_pgn_node(&caller->mm->fifo_pgn, pgn + pgit);
+    /* Off-line page, it joins the replacement list once faulted in */
   }
 
   /* =============== */
@@ -152,51 +192,83 @@ int vmap_page_range(struct pcb_t *caller,           // process call
  * alloc_pages_range - allocate req_pgnum of frame in ram
  * @caller    : caller
  * @req_pgnum : request page num
- * @frm_lst   : frame list
+ * @frames    : room for req_pgnum entries, the frames in ram in ascending
+ *              page order then the swap slots of pages that did not fit
+ * @nram      : return the number of frames in ram
  */
-
-int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struct **frm_lst, struct framephy_struct **frm_lst_swap)
+int alloc_pages_range(struct pcb_t *caller, int req_pgnum, int *frames, int *nram)
 {
   /* TODO */
-  int pgit, fpn;
-  // struct framephy_struct *newfp_str;
-  int flag_half_in_ram = 0, flag_half_in_swap = 0;
+  int pgit, fpn, order, blkit;
 
-  for (pgit = 0; pgit < req_pgnum; pgit++)
+  /* Multi-page region, take the largest buddy blocks first so it lands
+   * on as few physically contiguous spans as possible */
+  pgit = 0;
+  for (order = MEMPHY_MAX_ORDER; order > 0; order--)
   {
-    if (MEMPHY_get_freefp(caller->mram, &fpn) == 0)
+    while (req_pgnum - pgit >= (1 << order) &&
+           MEMPHY_try_freefp_order(caller->mram, order, &fpn) == 0)
     {
-      flag_half_in_ram = 1;
+      for (blkit = 0; blkit < (1 << order); blkit++)
+      {
+        frames[pgit + blkit] = fpn + blkit;
+        MEMPHY_put_usedfp(caller->mram, fpn + blkit);
+      }
+      pgit += 1 << order;
+    }
+  }
 
-      struct framephy_struct *node = malloc(sizeof(struct framephy_struct));
-      node->fpn = fpn;
-      node->owner = caller->mm;
-      node->fp_next = *frm_lst;
-      (*frm_lst) = node;
+  /* The rest in one allocator transaction, then what the magazines hold */
+  pgit += MEMPHY_get_freefp_bulk(caller->mram, req_pgnum - pgit, frames + pgit);
+  while (pgit < req_pgnum && MEMPHY_get_freefp(caller->mram, &fpn) == 0)
+  {
+    frames[pgit++] = fpn;
+    MEMPHY_put_usedfp(caller->mram, fpn);
+  }
+  *nram = pgit;
 
-      MEMPHY_put_usedfp(caller->mram,fpn);
-    }
-    else
-    { // ERROR CODE of obtaining somes but not enough frames
-      if (MEMPHY_get_freefp(caller->active_mswp,&fpn) == 0) {
-        flag_half_in_swap = 1;
-
-        struct framephy_struct *node = malloc(sizeof(struct framephy_struct));
-        node->fpn = fpn;
-        node->owner = caller->mm;
-        node->fp_next = *frm_lst_swap;
-        (*frm_lst_swap) = node;
-
-        MEMPHY_put_usedfp(caller->active_mswp,fpn);
-      } else {
-        return -3000;
-      }
+  for (; pgit < req_pgnum; pgit++)
+  { // ERROR CODE of obtaining somes but not enough frames
+    /* frames[] holds a swap slot here, see PAGING_SWPSLOT */
+    if (swp_get_slot(caller, pgit, &frames[pgit]) != 0)
+    {
+      while (--pgit >= *nram)
+        swp_put_slot(caller, frames[pgit]);
+      MEMPHY_put_freefp_bulk(caller->mram, *nram, frames);
+      return -3000;
     }
   }
 
   return 0;
 }
 
+/*
+ * vm_map_huge - map one huge page with a single PTE
+ * @caller    : caller
+ * @pgn       : page number to map at, must be huge page aligned
+ * @pgnum     : pages left to map from pgn
+ * return 0 on success, -1 if not eligible or no contiguous block in ram
+ */
+int vm_map_huge(struct pcb_t *caller, int pgn, int pgnum)
+{
+  int fpn, fpit;
+
+  if (pgn % PAGING_HUGE_NPAGES != 0 || pgnum < PAGING_HUGE_NPAGES)
+    return -1;
+
+  if (MEMPHY_try_freefp_order(caller->mram, PAGING_HUGE_ORDER, &fpn) != 0)
+    return -1;
+
+  for (fpit = fpn; fpit < fpn + PAGING_HUGE_NPAGES; fpit++)
+    MEMPHY_put_usedfp(caller->mram, fpit);
+
+  pte_set_huge(&caller->mm->pgd[pgn], fpn);
+  enlist_pgn_node(&caller->mm->fifo_pgn, pgn);
+  caller->mm->nhuge++;
+
+  return 0;
+}
+
 /*
  * vm_map_ram - do the mapping all vm are to ram storage device
  * @caller    : caller
@@ -205,12 +277,14 @@ int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struc
  * @mapstart  : start mapping point
  * @incpgnum  : number of mapped page
  * @ret_rg    : returned region
+ *
+ * Only ALLOC without MM_DEMAND_PAGING maps this way, see os-cfg.h.
  */
 int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int incpgnum, struct vm_rg_struct *ret_rg)
 {
-  struct framephy_struct *frm_lst = NULL;
-  struct framephy_struct *frm_lst_swap = NULL;
-  int ret_alloc;
+  int *frames;
+  int ret_alloc, nram;
+  int pgit = 0, pgnum;
 
   /*@bksysnet: author provides a feasible solution of getting frames
    *FATAL logic in here, wrong behaviour if we have not enough page
@@ -219,23 +293,47 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
    *in endless procedure of swap-off to get frame and we have not provide
    *duplicate control mechanism, keep it simple
    */
-  ret_alloc = alloc_pages_range(caller, incpgnum, &frm_lst, &frm_lst_swap); // return list of free frame
+  while (pgit < incpgnum)
+  {
+    pgnum = incpgnum - pgit;
+#ifdef MM_HUGEPAGE
+    int addr = mapstart + pgit * PAGING_PAGESZ;
+    int pgn = PAGING_PGN(addr);
 
-  if (ret_alloc < 0 && ret_alloc != -3000)
-    return -1;
+    if (vm_map_huge(caller, pgn, pgnum) == 0)
+    {
+      pgit += PAGING_HUGE_NPAGES;
+      continue;
+    }
 
-  /* Out of memory */
-  if (ret_alloc == -3000)
-  {
+    /* Base pages upto the next huge page boundary */
+    if (pgnum > PAGING_HUGE_NPAGES - pgn % PAGING_HUGE_NPAGES)
+      pgnum = PAGING_HUGE_NPAGES - pgn % PAGING_HUGE_NPAGES;
+#endif
+
+    frames = malloc(pgnum * sizeof(int));
+    ret_alloc = alloc_pages_range(caller, pgnum, frames, &nram); // return array of free frame
+    if (ret_alloc < 0)
+      free(frames);
+
+    if (ret_alloc < 0 && ret_alloc != -3000)
+      return -1;
+
+    /* Out of memory */
+    if (ret_alloc == -3000)
+    {
 #ifdef MMDBG
-    printf("OOM: vm_map_ram out of memory \n");
+      printf("OOM: vm_map_ram out of memory \n");
 #endif
-    return -1;
-  }
+      return -1;
+    }
 
-  /* it leaves the case of memory is enough but half in ram, half in swap
-   * do the swaping all to swapper to get the all in ram */
-  vmap_page_range(caller, mapstart, incpgnum, frm_lst, ret_rg,frm_lst_swap);
+    /* it leaves the case of memory is enough but half in ram, half in swap
+     * do the swaping all to swapper to get the all in ram */
+    vmap_page_range(caller, mapstart + pgit * PAGING_PAGESZ, pgnum, frames, nram, ret_rg);
+    free(frames);
+    pgit += pgnum;
+  }
 
   return 0;
 }
@@ -248,19 +346,86 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
  **/
 int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
                    struct memphy_struct *mpdst, int dstfpn)
+{
+  return MEMPHY_cp_frame(mpsrc, srcfpn, mpdst, dstfpn);
+}
+
+/* The global memory lock the byte copy used to take */
+static pthread_mutex_t swap_cp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * __swap_cp_bytes - the former byte at a time page copy, kept to compare
+ * Each byte goes under the memory lock, as it did.
+ */
+static void __swap_cp_bytes(struct memphy_struct *mpsrc, int srcfpn,
+                            struct memphy_struct *mpdst, int dstfpn)
 {
   int cellidx;
-  int addrsrc, addrdst;
+  BYTE data;
+
   for (cellidx = 0; cellidx < PAGING_PAGESZ; cellidx++)
   {
-    addrsrc = srcfpn * PAGING_PAGESZ + cellidx;
-    addrdst = dstfpn * PAGING_PAGESZ + cellidx;
-
-    BYTE data;
-    MEMPHY_read(mpsrc, addrsrc, &data);
-    MEMPHY_write(mpdst, addrdst, data);
+    pthread_mutex_lock(&swap_cp_lock);
+    MEMPHY_read(mpsrc, srcfpn * PAGING_PAGESZ + cellidx, &data);
+    MEMPHY_write(mpdst, dstfpn * PAGING_PAGESZ + cellidx, data);
+    pthread_mutex_unlock(&swap_cp_lock);
   }
+}
+
+static double __bench_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * swap_cp_bench - measure the swap bandwidth of __swap_cp_page
+ * @nframes: frames copied by each method
+ *
+ * Copies from a 2 MB RAM device to a 16 MB swap device, byte by byte
+ * the way swapping used to and then with whole frames.
+ */
+int swap_cp_bench(int nframes)
+{
+  struct memphy_struct ram, swp;
+  int ramfp, swpfp, it, failed;
+  double start, bytesec, framesec;
 
+  if (nframes <= 0)
+    return -1;
+
+  /* Both are set up, even empty, so both can be freed */
+  failed = init_memphy(&ram, 0x200000, 1) != 0;
+  failed |= init_memphy(&swp, 0x1000000, 1) != 0;
+  if (failed)
+  {
+    free_memphy(&ram);
+    free_memphy(&swp);
+    return -1;
+  }
+  ramfp = ram.maxfp;
+  swpfp = swp.maxfp;
+
+  start = __bench_sec();
+  for (it = 0; it < nframes; it++)
+    __swap_cp_bytes(&ram, it % ramfp, &swp, (it * 7) % swpfp);
+  bytesec = __bench_sec() - start;
+
+  start = __bench_sec();
+  for (it = 0; it < nframes; it++)
+    __swap_cp_page(&ram, it % ramfp, &swp, (it * 7) % swpfp);
+  framesec = __bench_sec() - start;
+
+  printf("Swap copy of %d frames of %d bytes\n", nframes, PAGING_PAGESZ);
+  printf("  byte loop : %8.3f s %10.1f MB/s\n", bytesec,
+         (double)nframes * PAGING_PAGESZ / bytesec / 1e6);
+  printf("  whole page: %8.3f s %10.1f MB/s\n", framesec,
+         (double)nframes * PAGING_PAGESZ / framesec / 1e6);
+
+  free_memphy(&ram);
+  free_memphy(&swp);
   return 0;
 }
 
@@ -273,12 +438,26 @@ int init_mm(struct mm_struct *mm, struct pcb_t *caller)
 {
   struct vm_area_struct *vma = malloc(sizeof(struct vm_area_struct));
 
-  mm->pgd = malloc(PAGING_MAX_PGN * sizeof(uint32_t));
+  mm->pgd = calloc(PAGING_MAX_PGN, sizeof(uint32_t));
+  init_pgn_list(&mm->fifo_pgn, PAGING_MAX_PGN);
+
+  /* No on-line page has a copy in swap yet */
+  mm->swp_slot = malloc(PAGING_MAX_PGN * sizeof(int));
+  for (int pgit = 0; pgit < PAGING_MAX_PGN; pgit++)
+    mm->swp_slot[pgit] = -1;
+  mm->shm_list = NULL;
+  mm->ksm_cursor = 0;
+  pthread_mutex_init(&mm->mm_lock, NULL);
+  mm->pg_atime = calloc(PAGING_MAX_PGN, sizeof(uint32_t));
+  mm->nhuge = 0;
+  mm->rss_limit = 0;
+  mm->wss_peak = 0;
 
   /* By default the owner comes with at least one vma */
   vma->vm_id = 1;
   vma->vm_start = 0;
   vma->vm_end = vma->vm_start;
+  vma->vm_freerg_list = NULL;
   vma->sbrk = vma->vm_start;
   struct vm_rg_struct *first_rg = init_vm_rg(vma->vm_start, vma->vm_end); //make dummy head
   enlist_vm_rg_node(&vma->vm_freerg_list, first_rg);
@@ -293,6 +472,320 @@ int init_mm(struct mm_struct *mm, struct pcb_t *caller)
   return 0;
 }
 
+/*
+ * copy_mm - duplicate an address space for FORK
+ * @mm:     new mm, not initialized
+ * @src:    mm to copy
+ * @caller: owner of src
+ *
+ * On-line frames are shared copy-on-write, both PTEs lose write access
+ * and the frame gains a reference. Swapped pages get their own slot.
+ * The slots are taken first, if swap runs out the parent is left as it
+ * was and everything of the child is freed.
+ */
+int copy_mm(struct mm_struct *mm, struct mm_struct *src, struct pcb_t *caller)
+{
+  struct vm_area_struct *vmait, **vmatail = &mm->mmap;
+  struct vm_rg_struct *rgit, **rgtail;
+  int pgn, swpslot;
+  uint32_t pte;
+
+  mm->pgd = calloc(PAGING_MAX_PGN, sizeof(uint32_t));
+  init_pgn_list(&mm->fifo_pgn, PAGING_MAX_PGN);
+
+  /* Swap slots stay with the parent, the child starts unassociated */
+  mm->swp_slot = malloc(PAGING_MAX_PGN * sizeof(int));
+  for (pgn = 0; pgn < PAGING_MAX_PGN; pgn++)
+    mm->swp_slot[pgn] = -1;
+  mm->shm_list = NULL;
+  mm->ksm_cursor = 0;
+  pthread_mutex_init(&mm->mm_lock, NULL);
+
+  /* The child keeps the limit and starts with the working set of its parent */
+  mm->pg_atime = malloc(PAGING_MAX_PGN * sizeof(uint32_t));
+  memcpy(mm->pg_atime, src->pg_atime, PAGING_MAX_PGN * sizeof(uint32_t));
+  mm->nhuge = 0; /* huge pages of the parent are shared split */
+  mm->rss_limit = src->rss_limit;
+  mm->wss_peak = 0;
+  mm->mmap = NULL;
+
+  /* Swapped pages first, nothing of the parent changes before they fit */
+  for (pgn = 0; pgn < PAGING_MAX_PGN; pgn++)
+  {
+    pte = src->pgd[pgn];
+    if (!(pte & PAGING_PTE_SWAPPED_MASK) || PAGING_PAGE_PRESENT(pte) ||
+        shm_find(src, pgn))
+      continue;
+
+    if (swp_get_slot(caller, pgn, &swpslot) != 0)
+    {
+      free_mm_tables(mm, caller);
+      return -1;
+    }
+
+    swp_cp_slot(caller, PAGING_PTE_SWPSLOT(pte), swpslot);
+    pte_set_swap(&mm->pgd[pgn], PAGING_SWPSLOT_TYP(swpslot), PAGING_SWPSLOT_OFF(swpslot));
+  }
+
+  for (vmait = src->mmap; vmait != NULL; vmait = vmait->vm_next)
+  {
+    struct vm_area_struct *vma = malloc(sizeof(struct vm_area_struct));
+
+    *vma = *vmait;
+    vma->vm_mm = mm;
+    vma->vm_next = NULL;
+    vma->vm_freerg_list = NULL;
+
+    rgtail = &vma->vm_freerg_list;
+    for (rgit = vmait->vm_freerg_list; rgit != NULL; rgit = rgit->rg_next)
+    {
+      *rgtail = init_vm_rg(rgit->rg_start, rgit->rg_end);
+      rgtail = &(*rgtail)->rg_next;
+    }
+
+    *vmatail = vma;
+    vmatail = &vma->vm_next;
+  }
+
+  memcpy(mm->symrgtbl, src->symrgtbl, sizeof(mm->symrgtbl));
+
+  for (pgn = 0; pgn < PAGING_MAX_PGN; pgn++)
+  {
+#ifdef MM_HUGEPAGE
+    /* Sharing is tracked per base frame */
+    pg_split_huge(src, pgn);
+#endif
+    pte = src->pgd[pgn];
+
+    /* Shared segments are attached again by shm_fork */
+    if (pte != 0 && shm_find(src, pgn))
+      continue;
+
+    if (PAGING_PAGE_PRESENT(pte))
+    {
+      SETBIT(src->pgd[pgn], PAGING_PTE_COW_MASK);
+      mm->pgd[pgn] = src->pgd[pgn];
+      MEMPHY_ref_frame(caller->mram, PAGING_FPN(pte));
+      enlist_pgn_node(&mm->fifo_pgn, pgn);
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * free_mm_tables - free an mm that is gone, or a child that is not born
+ * @mm:     the mm, the struct itself is left to the caller
+ * @caller: owner of the devices its pages use, NULL when its PTEs hold
+ *          neither frame nor slot of their own, as for an mm being restored
+ *
+ * A frame still shared copy-on-write loses one reference and stays with
+ * the other sharers, the last one frees it. Shared segments must be
+ * detached already.
+ */
+void free_mm_tables(struct mm_struct *mm, struct pcb_t *caller)
+{
+  struct vm_area_struct *vma;
+  struct vm_rg_struct *rg;
+  uint32_t pte;
+  int pgn, fpit, ref;
+
+  for (pgn = 0; caller != NULL && pgn < PAGING_MAX_PGN; pgn++)
+  {
+    pte = mm->pgd[pgn];
+    if (mm->swp_slot[pgn] >= 0)
+      swp_put_slot(caller, mm->swp_slot[pgn]);
+
+    if (pte & PAGING_PTE_SWAPPED_MASK)
+      swp_put_slot(caller, PAGING_PTE_SWPSLOT(pte));
+    else if (PAGING_PAGE_PRESENT(pte) && PAGING_PAGE_HUGE(pte))
+    {
+      for (fpit = 0; fpit < PAGING_HUGE_NPAGES; fpit++)
+        MEMPHY_put_freefp(caller->mram, PAGING_FPN(pte) + fpit);
+    }
+    else if (PAGING_PAGE_PRESENT(pte))
+    {
+      if (MEMPHY_get_refcnt(caller->mram, PAGING_FPN(pte)) > 1)
+      {
+        ref = MEMPHY_unref_frame(caller->mram, PAGING_FPN(pte));
+#ifdef MM_KSM
+        ksm_unshare(PAGING_FPN(pte), ref);
+#endif
+      }
+      else
+        MEMPHY_put_freefp(caller->mram, PAGING_FPN(pte));
+    }
+  }
+
+  while ((vma = mm->mmap) != NULL)
+  {
+    mm->mmap = vma->vm_next;
+    while ((rg = vma->vm_freerg_list) != NULL)
+    {
+      vma->vm_freerg_list = rg->rg_next;
+      free(rg);
+    }
+    free(vma);
+  }
+
+  free(mm->pgd);
+  free(mm->swp_slot);
+  free(mm->pg_atime);
+  free(mm->fifo_pgn.pg_next);
+  free(mm->fifo_pgn.pg_prev);
+  free(mm->fifo_pgn.pg_age);
+  pthread_mutex_destroy(&mm->mm_lock);
+}
+
+/*
+ * mm_save - write an address space to a checkpoint
+ * @file: checkpoint file
+ * @mm:   mm to save, its shared segments go with shm_save
+ */
+int mm_save(FILE *file, struct mm_struct *mm)
+{
+  struct pgn_list *pl = &mm->fifo_pgn;
+  struct vm_area_struct *vmait;
+  struct vm_rg_struct *rgit;
+  int hdr[7] = {pl->head, pl->tail, pl->count, pl->hand,
+                mm->ksm_cursor, mm->rss_limit, mm->wss_peak};
+  unsigned long rec[5];
+  int symit, nvma = 0;
+
+  ckpt_write(file, hdr, sizeof(hdr));
+  ckpt_write(file, mm->pgd, PAGING_MAX_PGN * sizeof(uint32_t));
+  ckpt_write(file, mm->swp_slot, PAGING_MAX_PGN * sizeof(int));
+  ckpt_write(file, mm->pg_atime, PAGING_MAX_PGN * sizeof(uint32_t));
+  ckpt_write(file, pl->pg_next, PAGING_MAX_PGN * sizeof(int));
+  ckpt_write(file, pl->pg_prev, PAGING_MAX_PGN * sizeof(int));
+  ckpt_write(file, pl->pg_age, PAGING_MAX_PGN * sizeof(uint8_t));
+
+  for (symit = 0; symit < PAGING_MAX_SYMTBL_SZ; symit++)
+  {
+    rec[0] = mm->symrgtbl[symit].rg_start;
+    rec[1] = mm->symrgtbl[symit].rg_end;
+    ckpt_write(file, rec, 2 * sizeof(unsigned long));
+  }
+
+  /* Each vma with its free regions */
+  for (vmait = mm->mmap; vmait != NULL; vmait = vmait->vm_next)
+    nvma++;
+  ckpt_write(file, &nvma, sizeof(int));
+
+  for (vmait = mm->mmap; vmait != NULL; vmait = vmait->vm_next)
+  {
+    rec[0] = vmait->vm_id;
+    rec[1] = vmait->vm_start;
+    rec[2] = vmait->vm_end;
+    rec[3] = vmait->sbrk;
+    for (rec[4] = 0, rgit = vmait->vm_freerg_list; rgit != NULL; rgit = rgit->rg_next)
+      rec[4]++;
+    ckpt_write(file, rec, sizeof(rec));
+
+    for (rgit = vmait->vm_freerg_list; rgit != NULL; rgit = rgit->rg_next)
+    {
+      rec[0] = rgit->rg_start;
+      rec[1] = rgit->rg_end;
+      ckpt_write(file, rec, 2 * sizeof(unsigned long));
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * mm_restore - rebuild an address space saved by mm_save
+ * @img: checkpoint being read
+ * @mm:  new mm, not initialized
+ *
+ * On failure the tables are freed again, the struct is left to the caller.
+ */
+int mm_restore(struct ckpt_image *img, struct mm_struct *mm)
+{
+  struct pgn_list *pl = &mm->fifo_pgn;
+  struct vm_area_struct *vma, **vmatail = &mm->mmap;
+  struct vm_rg_struct **rgtail;
+  unsigned long rec[5], rg[2];
+  int hdr[7], symit, rgit, nvma, pgit;
+
+  if (ckpt_read(img, hdr, sizeof(hdr)) != 0)
+    return -1;
+
+  mm->pgd = malloc(PAGING_MAX_PGN * sizeof(uint32_t));
+  mm->swp_slot = malloc(PAGING_MAX_PGN * sizeof(int));
+  mm->pg_atime = malloc(PAGING_MAX_PGN * sizeof(uint32_t));
+  init_pgn_list(pl, PAGING_MAX_PGN);
+  mm->shm_list = NULL;
+  pthread_mutex_init(&mm->mm_lock, NULL);
+  mm->mmap = NULL;
+
+  pl->head = hdr[0];
+  pl->tail = hdr[1];
+  pl->count = hdr[2];
+  pl->hand = hdr[3];
+  mm->ksm_cursor = hdr[4];
+  mm->rss_limit = hdr[5];
+  mm->wss_peak = hdr[6];
+
+  if (ckpt_read(img, mm->pgd, PAGING_MAX_PGN * sizeof(uint32_t)) != 0 ||
+      ckpt_read(img, mm->swp_slot, PAGING_MAX_PGN * sizeof(int)) != 0 ||
+      ckpt_read(img, mm->pg_atime, PAGING_MAX_PGN * sizeof(uint32_t)) != 0 ||
+      ckpt_read(img, pl->pg_next, PAGING_MAX_PGN * sizeof(int)) != 0 ||
+      ckpt_read(img, pl->pg_prev, PAGING_MAX_PGN * sizeof(int)) != 0 ||
+      ckpt_read(img, pl->pg_age, PAGING_MAX_PGN * sizeof(uint8_t)) != 0)
+    goto fail;
+
+  mm->nhuge = 0;
+  for (pgit = 0; pgit < PAGING_MAX_PGN; pgit++)
+    if (PAGING_PAGE_PRESENT(mm->pgd[pgit]) && PAGING_PAGE_HUGE(mm->pgd[pgit]))
+      mm->nhuge++;
+
+  for (symit = 0; symit < PAGING_MAX_SYMTBL_SZ; symit++)
+  {
+    if (ckpt_read(img, rg, sizeof(rg)) != 0)
+      goto fail;
+    mm->symrgtbl[symit].rg_start = rg[0];
+    mm->symrgtbl[symit].rg_end = rg[1];
+    mm->symrgtbl[symit].rg_next = NULL;
+  }
+
+  if (ckpt_read(img, &nvma, sizeof(int)) != 0)
+    goto fail;
+
+  for (; nvma > 0; nvma--)
+  {
+    if (ckpt_read(img, rec, sizeof(rec)) != 0)
+      goto fail;
+
+    vma = malloc(sizeof(struct vm_area_struct));
+    vma->vm_id = rec[0];
+    vma->vm_start = rec[1];
+    vma->vm_end = rec[2];
+    vma->sbrk = rec[3];
+    vma->vm_mm = mm;
+    vma->vm_next = NULL;
+    vma->vm_freerg_list = NULL;
+    *vmatail = vma;
+    vmatail = &vma->vm_next;
+
+    rgtail = &vma->vm_freerg_list;
+    for (rgit = 0; rgit < (int)rec[4]; rgit++)
+    {
+      if (ckpt_read(img, rg, sizeof(rg)) != 0)
+        goto fail;
+      *rgtail = init_vm_rg(rg[0], rg[1]);
+      rgtail = &(*rgtail)->rg_next;
+    }
+  }
+
+  if (mm->mmap != NULL)
+    return 0;
+
+fail:
+  free_mm_tables(mm, NULL);
+  return -1;
+}
+
 struct vm_rg_struct *init_vm_rg(int rg_start, int rg_end)
 {
   struct vm_rg_struct *rgnode = malloc(sizeof(struct vm_rg_struct));
@@ -312,32 +805,94 @@ int enlist_vm_rg_node(struct vm_rg_struct **rglist, struct vm_rg_struct *rgnode)
   return 0;
 }
 
-int enlist_pgn_node(struct pgn_t **plist, int pgn)
+int init_pgn_list(struct pgn_list *pgnlist, int maxpgn)
+{
+  int pgit;
+
+  pgnlist->head = pgnlist->tail = pgnlist->hand = -1;
+  pgnlist->count = 0;
+  pgnlist->pg_next = malloc(maxpgn * sizeof(int));
+  pgnlist->pg_prev = malloc(maxpgn * sizeof(int));
+  pgnlist->pg_age = calloc(maxpgn, sizeof(uint8_t));
+
+  /* pg_prev of -2 marks a page that is not on the list */
+  for (pgit = 0; pgit < maxpgn; pgit++)
+  {
+    pgnlist->pg_next[pgit] = -1;
+    pgnlist->pg_prev[pgit] = -2;
+  }
+
+  return 0;
+}
+
+/* remove pgn from pgnlist if it is on it, O(1) */
+int remove_pgn_node(struct pgn_list *pgnlist, int pgn)
 {
+  int prev = pgnlist->pg_prev[pgn];
+  int next = pgnlist->pg_next[pgn];
+
+  if (prev == -2)
+    return -1;
 
-  struct pgn_t *pnode = malloc(sizeof(struct pgn_t));
+  if (prev == -1)
+    pgnlist->head = next;
+  else
+    pgnlist->pg_next[prev] = next;
 
-  pnode->pgn = pgn;
-  pnode->pg_next = *plist;
-  *plist = pnode;
+  if (next == -1)
+    pgnlist->tail = prev;
+  else
+    pgnlist->pg_prev[next] = prev;
+
+  pgnlist->pg_next[pgn] = -1;
+  pgnlist->pg_prev[pgn] = -2;
+  pgnlist->count--;
+
+  /* Keep the clock hand on a listed page */
+  if (pgnlist->hand == pgn)
+    pgnlist->hand = (next != -1) ? next : pgnlist->head;
 
   return 0;
 }
 
-/* delist pgn_t* fifo and return the pgn, if pgnlisr empty => -1 */
-int delist_pgn_node(struct pgn_t **pgnlist) {
-  struct pgn_t *pnode = *pgnlist;
+/* enqueue pgn as the newest page, a page already listed is moved there */
+int enlist_pgn_node(struct pgn_list *pgnlist, int pgn)
+{
+  if (remove_pgn_node(pgnlist, pgn) != 0)
+    pgnlist->pg_age[pgn] = 0;
 
-  if ((*pgnlist) == NULL)
+  pgnlist->pg_prev[pgn] = pgnlist->tail;
+  pgnlist->pg_next[pgn] = -1;
+
+  if (pgnlist->tail == -1)
+    pgnlist->head = pgn;
+  else
+    pgnlist->pg_next[pgnlist->tail] = pgn;
+
+  pgnlist->tail = pgn;
+  pgnlist->count++;
+
+  return 0;
+}
+
+/* move a listed pgn to the newest end, unlisted pages are left alone */
+int touch_pgn_node(struct pgn_list *pgnlist, int pgn)
+{
+  if (pgnlist->pg_prev[pgn] == -2)
     return -1;
 
-  while (pnode != NULL && pnode->pg_next != NULL)
-    pnode = pnode->pg_next;
+  return enlist_pgn_node(pgnlist, pgn);
+}
+
+/* dequeue the oldest pgn and return it, if pgnlist empty => -1 */
+int delist_pgn_node(struct pgn_list *pgnlist)
+{
+  int pgn = pgnlist->head;
 
-  //  *pgnlist = (*pgnlist)->pg_next;
-  int pgn = pnode->pgn;
+  if (pgn == -1)
+    return -1;
 
-  free(pnode);
+  remove_pgn_node(pgnlist, pgn);
 
   return pgn;
 }
@@ -402,19 +957,20 @@ int print_list_vma(struct vm_area_struct *ivma)
   return 0;
 }
 
-int print_list_pgn(struct pgn_t *ip)
+int print_list_pgn(struct pgn_list *ip)
 {
+  int pgn;
+
   printf("print_list_pgn: ");
-  if (ip == NULL)
+  if (ip == NULL || ip->head == -1)
   {
     printf("NULL list\n");
     return -1;
   }
   printf("\n");
-  while (ip != NULL)
+  for (pgn = ip->head; pgn != -1; pgn = ip->pg_next[pgn])
   {
-    printf("va[%d]-\n", ip->pgn);
-    ip = ip->pg_next;
+    printf("va[%d]-\n", pgn);
   }
   printf("n");
   return 0;
@@ -4,6 +4,7 @@
 #include "sched.h"
 #include "loader.h"
 #include "mm.h"
+#include "checkpoint.h"
 
 #include <pthread.h>
 #include <stdio.h>
@@ -16,7 +17,8 @@ static int num_cpus;
 static int done = 0;
 
 #ifdef MM_PAGING
-static int memramsz;
+static int memramsz[MEMPHY_MAX_NODES];
+static int memramnodes;
 static int memswpsz[PAGING_MAX_MMSWP];
 
 struct mmpaging_ld_args {
@@ -34,9 +36,28 @@ static struct ld_args{
 #ifdef MLQ_SCHED
 	unsigned long * prio;
 #endif
+#ifdef MM_PAGING
+	int * rss_limit;
+#endif
 } ld_processes;
 int num_processes;
 
+/* Loader progress: next process of the config and the one loaded but
+ * waiting for its start time */
+static int ld_next = 0;
+static struct pcb_t * ld_pending = NULL;
+
+static struct cpu_state * cpu_state;
+
+/* Checkpoint requested with -c */
+static const char * ckpt_path = NULL;
+static uint64_t ckpt_time;
+#ifdef MM_PAGING
+static struct memphy_struct * ckpt_mram;
+static struct memphy_struct ** ckpt_mswp;
+#endif
+static int ckpt_taken = 0;
+
 struct cpu_args {
 	struct timer_id_t * timer_id;
 	int id;
@@ -46,16 +67,28 @@ struct cpu_args {
 static void * cpu_routine(void * args) {
 	struct timer_id_t * timer_id = ((struct cpu_args*)args)->timer_id;
 	int id = ((struct cpu_args*)args)->id;
-	/* Check for new process in ready queue */
-	int time_left = 0;
-	struct pcb_t * proc = NULL;
-	while (1) {
+#ifdef MM_PAGING
+	tlb_bind_cpu(id);
+	MEMPHY_bind_cpu(id);
+#endif
+	/* Its state lives in cpu_state, a checkpoint sees it between slots */
+	struct cpu_state * cpu = &cpu_state[id];
+	while (!cpu->stopped) {
+		/* Remote MEMRAM accesses and device seeks of the last
+		 * instruction stall the CPU, out of the same slice */
+		while (cpu->stall > 0 && cpu->time_left > 0) {
+			cpu->stall--;
+			cpu->time_left--;
+			next_slot(timer_id);
+		}
+		cpu->stall = 0;
+
 		/* Check the status of current process */
-		if (proc == NULL) {
+		if (cpu->proc == NULL) {
 			/* No process is running, the we load new process from
 		 	* ready queue */
-			proc = get_proc();
-			if (proc == NULL) {
+			cpu->proc = get_proc();
+			if (cpu->proc == NULL) {
 							// if (done) {
 							// 	printf("\tCPU %d stopped\n", id);
 							// 	break;
@@ -63,43 +96,78 @@ static void * cpu_routine(void * args) {
 							next_slot(timer_id);
                            	continue; /* First load failed. skip dummy load */
                         }
-		}else if (proc->pc == proc->code->size) {
+		}else if (cpu->proc->pc == cpu->proc->code->size) {
 			/* The porcess has finish it job */
 			printf("\tCPU %d: Processed %2d has finished\n",
-				id ,proc->pid);
+				id ,cpu->proc->pid);
 			/* dump RAM */
-			MEMPHY_dump(proc->mram);
+			MEMPHY_dump(cpu->proc->mram);
+#ifdef MM_PAGING
+#ifdef MM_WSS_WINDOW
+			print_wss(cpu->proc);
+#endif
+			shm_exit(cpu->proc->mm, cpu->proc);
+			tlb_flush_pid(cpu->proc->pid);
+#ifdef MM_KSM
+			ksm_exit(cpu->proc);
+#endif
+#ifdef MM_KSWAPD_LOW
+			kswapd_unregister(cpu->proc);
+#endif
+			/* Frames it still shares copy-on-write go to the others */
+			free_mm_tables(cpu->proc->mm, cpu->proc);
+			free(cpu->proc->mm);
+#endif
 
-			free(proc);
-			proc = get_proc();
-			time_left = 0;
-		}else if (time_left == 0) {
+			free(cpu->proc);
+			cpu->proc = get_proc();
+			cpu->time_left = 0;
+		}else if (cpu->time_left == 0) {
 			/* The process has done its job in current time slot */
 			printf("\tCPU %d: Put process %2d to run queue\n",
-				id, proc->pid);
-			put_proc(proc);
-			proc = get_proc();
+				id, cpu->proc->pid);
+#if defined(MM_PAGING) && defined(MM_WSS_WINDOW)
+			print_wss(cpu->proc);
+#endif
+			put_proc(cpu->proc);
+			cpu->proc = get_proc();
 		}
 		
 		/* Recheck process status after loading new process */
-		if (proc == NULL && done) {
+		if (cpu->proc == NULL && done) {
 			/* No process to run, exit */
 			printf("\tCPU %d stopped\n", id);
+			cpu->stopped = 1;
 			break;
-		}else if (proc == NULL) {
+		}else if (cpu->proc == NULL) {
 			/* There may be new processes to run in
 			 * next time slots, just skip current slot */
 			next_slot(timer_id);
 			continue;
-		}else if (time_left == 0) {
+		}else if (cpu->time_left == 0) {
 			printf("\tCPU %d: Dispatched process %2d\n",
-				id, proc->pid);
-			time_left = time_slot;
+				id, cpu->proc->pid);
+			cpu->time_left = time_slot;
 		}
 		
 		/* Run current process */
-		run(proc);
-		time_left--;
+#ifdef MM_PAGING
+		pthread_mutex_lock(&cpu->proc->mm->mm_lock);
+#endif
+		run(cpu->proc);
+		cpu->time_left--;
+#if defined(MM_PAGING) && defined(MM_KSM)
+		ksm_scan(cpu->proc);
+#endif
+#ifdef MM_PAGING
+		pthread_mutex_unlock(&cpu->proc->mm->mm_lock);
+#endif
+#if defined(MM_PAGING) && defined(MM_NUMA_REMOTE_COST)
+		cpu->stall += numa_stall();
+#endif
+#if defined(MM_PAGING) && defined(MM_SEEK_COST)
+		cpu->stall += MEMPHY_seek_stall();
+#endif
 		next_slot(timer_id);
 	}
 	detach_event(timer_id);
@@ -115,37 +183,84 @@ static void * ld_routine(void * args) {
 #else
 	struct timer_id_t * timer_id = (struct timer_id_t*)args;
 #endif
-	int i = 0;
+	int i;
 	printf("ld_routine\n");
-	while (i < num_processes) {
-		struct pcb_t * proc = load(ld_processes.path[i]);
+	while ((i = ld_next) < num_processes) {
+		if (ld_pending == NULL) {
+			ld_pending = load(ld_processes.path[i]);
 #ifdef MLQ_SCHED
-		proc->prio = ld_processes.prio[i];
+			ld_pending->prio = ld_processes.prio[i];
 #endif
+		}
+		struct pcb_t * proc = ld_pending;
 		while (current_time() < ld_processes.start_time[i]) {
 			next_slot(timer_id);
 		}
 #ifdef MM_PAGING
 		proc->mm = malloc(sizeof(struct mm_struct));
 		init_mm(proc->mm, proc);
+		proc->mm->rss_limit = ld_processes.rss_limit[i];
 		proc->mram = mram;
 		proc->mswp = mswp;
 		proc->active_mswp = active_mswp;
+#ifdef MM_KSWAPD_LOW
+		kswapd_register(proc);
+#endif
 #endif
 		printf("\tLoaded a process at %s, PID: %d PRIO: %ld\n",
 			ld_processes.path[i], proc->pid, ld_processes.prio[i]);
 		add_proc(proc);
+		ld_pending = NULL;
 		free(ld_processes.path[i]);
-		i++;
+		ld_next++;
 		next_slot(timer_id);
 	}
 	free(ld_processes.path);
 	free(ld_processes.start_time);
+#ifdef MM_PAGING
+	free(ld_processes.rss_limit);
+#endif
 	done = 1;
 	detach_event(timer_id);
 	pthread_exit(NULL);
 }
 
+/* Timer hook, every thread waits for the next time slot */
+static void os_checkpoint(void) {
+	struct ckpt_os os;
+	os.num_cpus = num_cpus;
+	os.cpus = cpu_state;
+	os.num_processes = num_processes;
+	os.ld_next = ld_next;
+	os.ld_pending = ld_pending;
+#ifdef MM_PAGING
+	os.mram = ckpt_mram;
+	os.mswp = ckpt_mswp;
+#endif
+	if (checkpoint_save(ckpt_path, &os) != 0) {
+		printf("Cannot write checkpoint %s\n", ckpt_path);
+	}else{
+		printf("Checkpoint at time slot %lu saved to %s\n",
+			current_time(), ckpt_path);
+	}
+	ckpt_taken = 1;
+}
+
+#ifdef MM_PAGING
+/* Read one more number of the current config line, 0 if there is none */
+static int read_line_int(FILE * file, int * val) {
+	int c;
+	while ((c = fgetc(file)) == ' ' || c == '\t');
+	if (c >= '0' && c <= '9') {
+		ungetc(c, file);
+		return fscanf(file, "%d", val) == 1;
+	}
+	if (c != EOF)
+		ungetc(c, file);
+	return 0;
+}
+#endif
+
 static void read_config(const char * path) {
 	FILE * file;
 	file = fopen(path, "r");
@@ -165,7 +280,8 @@ static void read_config(const char * path) {
 	 * for legacy info 
          *  [time slice] [N = Number of CPU] [M = Number of Processes to be run]
          */
-        memramsz    =  0x100000;
+        memramsz[0] =  0x100000;
+        memramnodes =  1;
         memswpsz[0] = 0x1000000;
 	for(sit = 1; sit < PAGING_MAX_MMSWP; sit++)
 		memswpsz[sit] = 0;
@@ -173,8 +289,12 @@ static void read_config(const char * path) {
 	/* Read input config of memory size: MEMRAM and upto 4 MEMSWP (mem swap)
 	 * Format: (size=0 result non-used memswap, must have RAM and at least 1 SWAP)
 	 *        MEM_RAM_SZ MEM_SWP0_SZ MEM_SWP1_SZ MEM_SWP2_SZ MEM_SWP3_SZ
+	 * A MEMRAM of several nodes gives the size of each, colon separated
+	 *        MEM_RAM0_SZ[:MEM_RAM1_SZ[:MEM_RAM2_SZ[:MEM_RAM3_SZ]]]
 	*/
-	fscanf(file, "%d\n", &memramsz);
+	fscanf(file, "%d", &memramsz[0]);
+	for (memramnodes = 1; memramnodes < MEMPHY_MAX_NODES &&
+	     fscanf(file, ":%d", &memramsz[memramnodes]) == 1; memramnodes++);
 	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++)
 		fscanf(file, "%d", &(memswpsz[sit])); 
 
@@ -185,6 +305,9 @@ static void read_config(const char * path) {
 #ifdef MLQ_SCHED
 	ld_processes.prio = (unsigned long*)
 		malloc(sizeof(unsigned long) * num_processes);
+#endif
+#ifdef MM_PAGING
+	ld_processes.rss_limit = (int*)malloc(sizeof(int) * num_processes);
 #endif
 	int i;
 	for (i = 0; i < num_processes; i++) {
@@ -193,20 +316,72 @@ static void read_config(const char * path) {
 		strcat(ld_processes.path[i], "input/proc/");
 		char proc[100];
 #ifdef MLQ_SCHED
-		fscanf(file, "%lu %s %lu\n", &ld_processes.start_time[i], proc, &ld_processes.prio[i]);
+		fscanf(file, "%lu %s %lu", &ld_processes.start_time[i], proc, &ld_processes.prio[i]);
 #else
-		fscanf(file, "%lu %s\n", &ld_processes.start_time[i], proc);
+		fscanf(file, "%lu %s", &ld_processes.start_time[i], proc);
+#endif
+#ifdef MM_PAGING
+		/* Optional resident set limit in bytes, at the end of the line */
+		ld_processes.rss_limit[i] = 0;
+		if (read_line_int(file, &ld_processes.rss_limit[i]))
+			ld_processes.rss_limit[i] =
+				DIV_ROUND_UP(ld_processes.rss_limit[i], PAGING_PAGESZ);
 #endif
+		fscanf(file, "\n");
 		strcat(ld_processes.path[i], proc);
 	}
 }
 
 int main(int argc, char * argv[]) {
+	const char * restore_path = NULL;
+	/* Checkpoint options go first, they take the place of argv[0] */
+	while (argc >= 3 && argv[1][0] == '-' && argv[1][1] != 'd') {
+		if (strcmp(argv[1], "-c") == 0 && argc >= 4) {
+			ckpt_time = strtoul(argv[2], NULL, 10);
+			ckpt_path = argv[3];
+			argv += 3;
+			argc -= 3;
+		}else if (strcmp(argv[1], "-r") == 0) {
+			restore_path = argv[2];
+			argv += 2;
+			argc -= 2;
+		}else{
+			break;
+		}
+	}
 	/* Read config */
-	if (argc != 2) {
-		printf("Usage: os [path to configure file]\n");
+	if (argc < 2 || argc > 4) {
+		printf("Usage: os [-c time file] [-r file] [path to configure file] [fifo|sc|clock|lru] [rr|least|stripe]\n");
+		printf("       os -d [path to dump file] [dump number]\n");
+		printf("       os -b [number of frames]\n");
+		return 1;
+	}
+#ifdef MM_PAGING
+	/* Replay a memory dump instead of running */
+	if (argc >= 3 && strcmp(argv[1], "-d") == 0) {
+		if (MEMPHY_dump_view(argv[2], argc == 4 ? atoi(argv[3]) : -1) != 0) {
+			printf("Cannot read dump file %s\n", argv[2]);
+			return 1;
+		}
+		return 0;
+	}
+	/* Measure the swap page copy instead of running */
+	if (strcmp(argv[1], "-b") == 0) {
+		if (swap_cp_bench(argc >= 3 ? atoi(argv[2]) : 200000) != 0) {
+			printf("Cannot run the swap copy benchmark\n");
+			return 1;
+		}
+		return 0;
+	}
+	if (argc >= 3 && set_pgrepl_policy(argv[2]) < 0) {
+		printf("Unknown page replacement policy %s\n", argv[2]);
+		return 1;
+	}
+	if (argc == 4 && set_swp_policy(argv[3]) < 0) {
+		printf("Unknown swap device policy %s\n", argv[3]);
 		return 1;
 	}
+#endif
 	char path[100];
 	path[0] = '\0';
 	strcat(path, "input/");
@@ -225,7 +400,11 @@ int main(int argc, char * argv[]) {
 		args[i].id = i;
 	}
 	struct timer_id_t * ld_event = attach_event();
-	start_timer();
+#ifdef MM_KSWAPD_LOW
+	pthread_t kswapd;
+	struct kswapd_args kswapd_args;
+	kswapd_args.timer_id = attach_event();
+#endif
 
 #ifdef MM_PAGING
 	/* Init all MEMPHY include 1 MEMRAM and n of MEMSWP */
@@ -233,29 +412,97 @@ int main(int argc, char * argv[]) {
 
 	struct memphy_struct mram;
 	struct memphy_struct mswp[PAGING_MAX_MMSWP];
+	struct memphy_struct *mswp_devs[PAGING_MAX_MMSWP];
 
 
-	/* Create MEM RAM */
-	init_memphy(&mram, memramsz, rdmflag);
+	/* Create MEM RAM, one node per size given */
+	if (init_memphy_nodes(&mram, memramnodes, memramsz, rdmflag) != 0) {
+		printf("Cannot allocate MEMRAM\n");
+		exit(1);
+	}
+#ifdef MM_MAGAZINE
+	if (MEMPHY_init_magazines(&mram, num_cpus) < 0) {
+		printf("Cannot set up the frame magazines\n");
+		exit(1);
+	}
+#endif
+
+	/* One software TLB per CPU */
+	init_tlb(num_cpus);
 
         /* Create all MEM SWAP */ 
+#ifdef MM_SWP_SEQUENTIAL
+	rdmflag = 0; /* MEMSWP devices seek, see MM_SEEK_COST */
+#endif
 	int sit;
-	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++)
-	       init_memphy(&mswp[sit], memswpsz[sit], rdmflag);
+	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++) {
+#ifdef MM_SWP_FILE
+	       /* The device content lives on disk, MEMSWP<sit> */
+	       char swpfile[64];
+	       snprintf(swpfile, sizeof(swpfile), "%s%d", MM_SWP_FILE, sit);
+	       if (init_memphy_file(&mswp[sit], memswpsz[sit], rdmflag,
+	                            memswpsz[sit] > 0 ? swpfile : NULL) != 0) {
+		       printf("Cannot map swap file %s\n", swpfile);
+		       exit(1);
+	       }
+#else
+	       if (init_memphy(&mswp[sit], memswpsz[sit], rdmflag) != 0) {
+		       printf("Cannot allocate swap %d\n", sit);
+		       exit(1);
+	       }
+#endif
+	       mswp_devs[sit] = &mswp[sit];
+	}
 
 	/* In Paging mode, it needs passing the system mem to each PCB through loader*/
 	struct mmpaging_ld_args *mm_ld_args = malloc(sizeof(struct mmpaging_ld_args));
 
 	mm_ld_args->timer_id = ld_event;
 	mm_ld_args->mram = (struct memphy_struct *) &mram;
-	mm_ld_args->mswp = (struct memphy_struct**) &mswp;
+	mm_ld_args->mswp = mswp_devs;
 	mm_ld_args->active_mswp = (struct memphy_struct *) &mswp[0];
+	ckpt_mram = &mram;
+	ckpt_mswp = mswp_devs;
 #endif
 
 
 	/* Init scheduler */
 	init_scheduler();
 
+	cpu_state = (struct cpu_state*)calloc(num_cpus, sizeof(struct cpu_state));
+	if (restore_path != NULL) {
+		/* Pick the simulation up where the checkpoint left it */
+		struct ckpt_os os;
+		os.num_cpus = num_cpus;
+		os.cpus = cpu_state;
+		os.num_processes = num_processes;
+#ifdef MM_PAGING
+		os.mram = &mram;
+		os.mswp = mswp_devs;
+#endif
+		if (checkpoint_restore(restore_path, &os) != 0) {
+			printf("Cannot restore checkpoint %s\n", restore_path);
+			exit(1);
+		}
+		ld_next = os.ld_next;
+		ld_pending = os.ld_pending;
+		for (i = 0; i < ld_next; i++) {
+			free(ld_processes.path[i]);
+		}
+		printf("Restored checkpoint %s at time slot %lu\n",
+			restore_path, current_time());
+	}
+	if (ckpt_path != NULL) {
+		set_timer_hook(ckpt_time, os_checkpoint);
+	}
+	start_timer();
+
+#if defined(MM_PAGING) && defined(MM_KSWAPD_LOW)
+	/* Background reclaim of MEMRAM frames */
+	kswapd_args.mram = &mram;
+	pthread_create(&kswapd, NULL, kswapd_routine, (void*)&kswapd_args);
+#endif
+
 	/* Run CPU and loader */
 #ifdef MM_PAGING
 	pthread_create(&ld, NULL, ld_routine, (void*)mm_ld_args);
@@ -274,9 +521,35 @@ int main(int argc, char * argv[]) {
 		pthread_join(cpu[i], NULL);
 	}
 	pthread_join(ld, NULL);
+#ifdef MM_KSWAPD_LOW
+	kswapd_stop();
+	pthread_join(kswapd, NULL);
+#endif
 
 	/* Stop timer */
 	stop_timer();
+	if (ckpt_path != NULL && !ckpt_taken) {
+		printf("No checkpoint taken, the run ended before time slot %lu\n",
+			ckpt_time);
+	}
+
+#ifdef MM_PAGING
+	print_pgrepl_stats();
+	print_swp_stats(mswp_devs);
+#ifdef MM_KSM
+	print_ksm_stats();
+#endif
+#ifdef MM_KSWAPD_LOW
+	print_kswapd_stats();
+#endif
+#ifdef MM_NUMA_REMOTE_COST
+	print_numa_stats(&mram);
+#endif
+#ifdef MM_MAGAZINE
+	MEMPHY_print_magazines(&mram);
+#endif
+	print_tlb_stats();
+#endif
 
 	return 0;
 
@@ -1,6 +1,7 @@
 
 #include "queue.h"
 #include "sched.h"
+#include "checkpoint.h"
 #include <pthread.h>
 
 #include <stdlib.h>
@@ -155,3 +156,80 @@ void add_proc(struct pcb_t *proc)
 	pthread_mutex_unlock(&queue_lock);
 }
 #endif
+
+/* Queues a checkpoint covers, in a fixed order */
+static int sched_queues(struct queue_t ** queues)
+{
+	int nq = 0;
+#ifdef MLQ_SCHED
+	int i;
+	for (i = 0; i < MAX_PRIO; i++)
+		queues[nq++] = &mlq_ready_queue[i];
+#endif
+	queues[nq++] = &ready_queue;
+	queues[nq++] = &run_queue;
+	return nq;
+}
+
+/*
+ *  sched_procs - collect the queued processes, up to [max]
+ *  Return how many there are, all of them when [procs] is NULL.
+ */
+int sched_procs(struct pcb_t ** procs, int max)
+{
+	struct queue_t * queues[MAX_PRIO + 2];
+	int nq = sched_queues(queues), n = 0, q, i;
+
+	for (q = 0; q < nq; q++)
+		for (i = 0; i < queues[q]->size; i++) {
+			if (procs != NULL && n < max)
+				procs[n] = queues[q]->proc[i];
+			n++;
+		}
+	return (procs != NULL && n > max) ? max : n;
+}
+
+/*
+ *  sched_save - write every queue, its processes by PID
+ */
+void sched_save(FILE * file)
+{
+	struct queue_t * queues[MAX_PRIO + 2];
+	int nq = sched_queues(queues), q, i;
+	int32_t rec[2];
+	uint32_t pid;
+
+	for (q = 0; q < nq; q++) {
+		rec[0] = queues[q]->size;
+		rec[1] = queues[q]->slot;
+		ckpt_write(file, rec, sizeof(rec));
+		for (i = 0; i < queues[q]->size; i++) {
+			pid = queues[q]->proc[i]->pid;
+			ckpt_write(file, &pid, sizeof(pid));
+		}
+	}
+}
+
+/*
+ *  sched_restore - refill the queues saved by sched_save
+ */
+int sched_restore(struct ckpt_image * img)
+{
+	struct queue_t * queues[MAX_PRIO + 2];
+	int nq = sched_queues(queues), q, i;
+	int32_t rec[2];
+	uint32_t pid;
+
+	for (q = 0; q < nq; q++) {
+		if (ckpt_read(img, rec, sizeof(rec)) != 0 || rec[0] > MAX_QUEUE_SIZE)
+			return -1;
+		queues[q]->size = 0;
+		queues[q]->slot = rec[1];
+		for (i = 0; i < rec[0]; i++) {
+			if (ckpt_read(img, &pid, sizeof(pid)) != 0 || ckpt_find_pcb(pid) == NULL)
+				return -1;
+			enqueue(queues[q], ckpt_find_pcb(pid));
+		}
+	}
+	return 0;
+}
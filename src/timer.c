@@ -1,5 +1,6 @@
 
 #include "timer.h"
+#include "checkpoint.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -17,6 +18,10 @@ static uint64_t _time;
 static int timer_started = 0;
 static int timer_stop = 0;
 
+/* Called once every device waits for time slot [hook_time] */
+static void (*timer_hook)(void) = NULL;
+static uint64_t hook_time;
+
 
 static void * timer_routine(void * args) {
 	while (!timer_stop) {
@@ -43,6 +48,11 @@ static void * timer_routine(void * args) {
 
 		/* Increase the time slot */
 		_time++;
+
+		/* Nothing runs until the devices are let go */
+		if (timer_hook != NULL && _time == hook_time) {
+			timer_hook();
+		}
 		
 		/* Let devices continue their job */
 		for (temp = dev_list; temp != NULL; temp = temp->next) {
@@ -80,6 +90,15 @@ uint64_t current_time() {
 	return _time;
 }
 
+void set_time(uint64_t time) {
+	_time = time;
+}
+
+void set_timer_hook(uint64_t time, void (*hook)(void)) {
+	hook_time = time;
+	timer_hook = hook;
+}
+
 void start_timer() {
 	timer_started = 1;
 	pthread_create(&_timer, NULL, timer_routine, NULL);